@@ -1,32 +1,377 @@
 #ifndef AQUALINK_INTRERNAL_H
 #define AQUALINK_INTRERNAL_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <libubox/uloop.h>
 
 struct device_ops;
+struct ustream;
+
+/* How urgently a frame should go out. Higher values jump ahead in queue. */
+enum aqua_priority {
+	AQUA_PRIO_PROBE,
+	AQUA_PRIO_ROUTINE,
+	AQUA_PRIO_URGENT,
+};
+
+#define HIST_NUM_BUCKETS	12
+
+struct latency_hist {
+	uint32_t buckets[HIST_NUM_BUCKETS];
+	uint64_t sum_us;
+	uint32_t count;
+	uint32_t max_us;
+};
+
+/* Bus time spent on one kind of traffic. Times are estimated airtime. */
+struct bus_usage {
+	unsigned long requests;
+	unsigned long tx_bytes;
+	unsigned long rx_bytes;
+	uint64_t tx_us;
+	uint64_t rx_us;
+	uint64_t gap_us;
+	/* Between request and reply, and for replies that never arrived */
+	uint64_t wait_us;
+	uint64_t timeout_us;
+};
+
+#define DEV_USAGE_CMDS		8
+
+struct cmd_usage {
+	uint8_t cmd;
+	struct bus_usage usage;
+};
+
+/* Per-device bus health, as reported by the "stats" control command */
+struct device_stats {
+	struct latency_hist queue_wait;
+	struct latency_hist round_trip;
+	struct latency_hist handler;
+	unsigned long requests;
+	unsigned long replies;
+	unsigned long timeouts;
+	unsigned long bad_checksums;
+	struct cmd_usage usage[DEV_USAGE_CMDS];
+	unsigned int num_usage;
+};
+
+/* Repeated log messages are let through at most this often. */
+#define LOG_RATELIMIT_US	(60 * 1000000ULL)
+
+struct ratelimit {
+	uint64_t next_us;
+	unsigned long missed;
+};
+
+/*
+ * Returns true if a message may be logged now, and sets 'missed' to how many
+ * were held back since the last one that was.
+ */
+static inline bool ratelimit_pass(struct ratelimit *rl, uint64_t now_us,
+				  unsigned long *missed)
+{
+	if (rl->next_us && now_us < rl->next_us) {
+		rl->missed++;
+		return false;
+	}
+
+	*missed = rl->missed;
+	rl->missed = 0;
+	rl->next_us = now_us + LOG_RATELIMIT_US;
+	return true;
+}
+
+/* Values in a history sample. Drivers name the ones they use in device_ops. */
+#define HISTORY_MAX_VALUES	3
+/* Samples held in memory before they are written to the ring file */
+#define HISTORY_BATCH		16
+
+struct history_sample {
+	uint32_t time_s;
+	int32_t values[HISTORY_MAX_VALUES];
+};
+
+struct history_file;
+
+/* Ring file of samples, see history.c. Disabled until opened. */
+struct history {
+	struct history_file *map;
+	size_t map_len;
+	uint32_t interval_s;
+	uint32_t last_s;
+	struct history_sample pending[HISTORY_BATCH];
+	unsigned int num_pending;
+};
+
+typedef void (*history_cb)(const struct history_sample *s, void *priv);
+
+int history_open(struct history *h, const char *path, uint32_t capacity,
+		 uint32_t interval_s);
+/* Records 'values', unless a sample was taken less than an interval ago. */
+void history_add(struct history *h, uint32_t now_s, const int32_t *values);
+void history_flush(struct history *h);
+size_t history_query(const struct history *h, uint32_t from_s, uint32_t to_s,
+		     history_cb cb, void *priv);
+void history_close(struct history *h);
 
 struct device {
+	struct list_head list;
 	struct uloop_timeout data_expired;
 	const struct device_ops *ops;
+	/* When the next routine poll is due, and how many frames are queued */
+	uint64_t next_poll_us;
+	unsigned int queued;
+	/* Current probe backoff, while the device does not answer */
+	unsigned int probe_interval_ms;
+	struct device_stats stats;
+	/* Round-trip estimate, from which the response timeout is derived */
+	uint32_t srtt_us;
+	uint32_t rttvar_us;
+	/* Longest reply the driver handles, as a message */
+	size_t max_reply_len;
+	/* When the last reply from the device arrived, 0 if it never has */
+	uint64_t last_reply_us;
+	/* State generation of the last change, see dev_state_changed() */
+	uint64_t state_gen;
+	struct ratelimit unhandled_log;
+	struct history history;
 	uint8_t addr;
 	int connected : 1;
 };
 
+/* RTT assumed for devices which have never replied */
+#define AQUA_INITIAL_RTT_US	20000
+/* Least slack over the smoothed RTT before a reply is given up on */
+#define AQUA_RTT_MARGIN_US	5000
+#define AQUA_MAX_TIMEOUT_MS	200
+
+void dev_update_rtt(struct device *dev, uint32_t rtt_us);
+void dev_rtt_backoff(struct device *dev);
+uint32_t dev_rtt_timeout_us(const struct device *dev, uint32_t floor_us);
+
+/* Most requests a device may have sent in one scheduling round */
+#define DEV_MAX_BATCH		4
+
+/* Handler for one reply command. Shorter replies never reach it. */
+struct device_cmd {
+	int (*handle)(struct device *dev, const uint8_t *reply, size_t len);
+	size_t min_len;
+};
+
 struct device_ops {
-	int (*handle_reply)(struct device *dev, const uint8_t *reply, size_t len);
-	int (*get_next_request)(struct device *dev, uint8_t* msg, size_t len);
+	const char *name;
+	/* Drivers keeping state embed struct device, and give their size here. */
+	size_t size;
+	/* Reply handlers, indexed by command byte. Holes are unhandled. */
+	const struct device_cmd *cmds;
+	size_t num_cmds;
+	/* Names of the values the driver records in dev->history, in order */
+	const char *const *history_fields;
+	unsigned int num_history_fields;
+	/* Sets up driver state, once the device is allocated and zeroed */
+	void (*init)(struct device *dev);
+	/*
+	 * Fills in request 'seq' of the batch for one scheduling round, and
+	 * returns its length. Called with seq = 0, 1, ... until it returns 0,
+	 * up to DEV_MAX_BATCH times. The requests go out back-to-back, in order.
+	 */
+	int (*get_next_request)(struct device *dev, unsigned int seq,
+				uint8_t *msg, size_t len);
+	/*
+	 * Returns the aqua_priority of the next request, and sets how often, in
+	 * milliseconds, the device wants to be polled. AQUA_PRIO_URGENT requests
+	 * are sent without waiting for the poll interval.
+	 */
+	int (*get_schedule)(struct device *dev, unsigned int *interval_ms);
+	/*
+	 * Prints the last known state of the device, one "key=value" line per
+	 * group of readings, each starting with 'prefix'. Must not touch the bus.
+	 */
+	void (*print_status)(struct device *dev, struct ustream *out,
+			     const char *prefix, uint64_t now_us);
+	/*
+	 * Handles a control socket command, named in argv[0], aimed at the
+	 * device. Returns -EOPNOTSUPP for commands the driver does not know,
+	 * 1 if requests need to go out, 0 or a negative error otherwise.
+	 */
+	int (*control)(struct device *dev, struct ustream *out, int argc,
+		       char **argv);
 };
 
 /* Unescape [10 00] to just [10] */
 size_t aqualink_unpack(uint8_t *dest, const uint8_t *buf, size_t len);
 size_t aqualink_pack(uint8_t *dest, const uint8_t *buf, size_t len);
 
+#define AQUALINK_MAX_MSG_LEN	32
+/* Worst case on the wire, with every payload byte and the checksum escaped */
+#define AQUALINK_FRAME_CAPACITY(len)	(2 * (len) + 7)
+#define AQUALINK_MAX_FRAME_LEN	AQUALINK_FRAME_CAPACITY(AQUALINK_MAX_MSG_LEN)
+
+enum aqualink_decoder_state {
+	AQ_DEC_HUNT,
+	AQ_DEC_HUNT_STX,
+	AQ_DEC_HDR_DLE,
+	AQ_DEC_HDR_STX,
+	AQ_DEC_DATA,
+	AQ_DEC_DLE,
+	AQ_DEC_NUM_STATES,
+};
+
+/* Incremental frame decoder. Bytes can be fed as they arrive. */
+struct aqualink_decoder {
+	uint8_t *dest;
+	size_t size;
+	size_t len;
+	uint8_t sum;
+	uint8_t state;
+};
+
+struct aqualink_parser;
+typedef void (*aqualink_msg_cb)(struct aqualink_parser *p, const uint8_t *msg,
+				int len);
+
+/* Byte stream parser. Finds frames among junk and hands them to 'msg_cb'. */
+struct aqualink_parser {
+	struct aqualink_decoder dec;
+	aqualink_msg_cb msg_cb;
+	/* The checksum is decoded along with the message, so it needs room. */
+	uint8_t msg[AQUALINK_MAX_MSG_LEN + 1];
+	/* Bytes on the wire of the frame passed to the last 'msg_cb' */
+	size_t frame_len;
+	unsigned long frames;
+	unsigned long errors;
+	unsigned long resyncs;
+	unsigned long junk_bytes;
+};
+
 size_t aqualink_msg_to_frame(uint8_t *dest, const uint8_t *msg, size_t len);
+size_t aqualink_frame_in_place(uint8_t *buf, size_t len);
 int aqualink_frame_to_msg(uint8_t *dest, const uint8_t *frame, size_t len);
+int aqualink_frame_to_msg_ref(uint8_t *dest, const uint8_t *frame, size_t len);
+
+void aqualink_decoder_init(struct aqualink_decoder *dec, uint8_t *dest,
+			   size_t size);
+/*
+ * Returns the message length once a frame is complete, -EAGAIN if more bytes
+ * are needed, or a negative error. 'consumed' is set to the number of bytes
+ * of 'buf' that were used.
+ */
+int aqualink_decoder_feed(struct aqualink_decoder *dec, const uint8_t *buf,
+			  size_t len, size_t *consumed);
+
+void aqualink_parser_init(struct aqualink_parser *p, aqualink_msg_cb msg_cb);
+void aqualink_parser_feed(struct aqualink_parser *p, const uint8_t *buf,
+			  size_t len);
+
+/* A driver, and the range of bus addresses its devices answer at */
+struct device_driver {
+	const struct device_ops *ops;
+	uint8_t first_addr;
+	uint8_t last_addr;
+};
+
+/* All drivers built into the daemon, see drivers.c */
+extern const struct device_driver *const aqua_drivers[];
+extern const size_t aqua_num_drivers;
+
+extern const struct device_driver jxi_heater_driver;
+
+/* Time base of the daemon, in microseconds */
+uint64_t monotonic_us(void);
+
+/*
+ * Drivers call this when the cached state of 'dev' changed. Subscribers hear
+ * of it once the current scheduling round is over.
+ */
+void dev_state_changed(struct device *dev);
+
+/* Command flags of the JXi control request */
+enum jxi_control_flags {
+	JXI_CTL_POOL = 0x01,
+	JXI_CTL_SPA = 0x02,
+	JXI_CTL_CELSIUS = 0x04,
+	JXI_CTL_HEATER_ON = 0x08,
+	JXI_CTL_EXT_TEMP_VALID = 0x10,
+};
+
+/* What the heater should be doing. Setpoints are in degrees. */
+struct jxi_control {
+	uint8_t flags;
+	int pool_setpoint;
+	int spa_setpoint;
+};
+
+/*
+ * Sets the state the heater should be brought to. Changes made before the
+ * next bus slot are sent together. Returns 1 if a command needs to go out,
+ * after which the caller should run the bus scheduler, 0 if the heater is
+ * already in that state, or a negative error.
+ */
+int jxi_heater_set_control(struct device *dev, const struct jxi_control *ctl);
+
+/*
+ * A command on the control socket. 'handler' writes its reply to 'out' and
+ * returns 0 or a negative error code.
+ */
+struct control_cmd {
+	struct list_head list;
+	const char *name;
+	const char *help;
+	int (*handler)(struct control_cmd *cmd, struct ustream *out, int argc,
+		       char **argv);
+};
+
+int control_init(const char *path);
+void control_register(struct control_cmd *cmd);
+
+/*
+ * Prints the state of all devices that changed after generation 'since', or
+ * of every device if 'since' is 0.
+ */
+typedef void (*control_publish_cb)(struct ustream *out, uint64_t since);
+
+void control_set_publisher(control_publish_cb cb);
+/* Tells subscribers that device state is now at generation 'gen'. */
+void control_publish(uint64_t gen);
+
+void hist_add(struct latency_hist *h, uint32_t us);
+void hist_print(struct ustream *out, const char *prefix, const char *name,
+		const struct latency_hist *h);
+struct bus_usage *usage_for_cmd(struct device_stats *stats, uint8_t cmd);
+void usage_add(struct bus_usage *dest, const struct bus_usage *delta);
+uint64_t usage_busy_us(const struct bus_usage *u);
+void usage_print(struct ustream *out, const char *prefix,
+		 const struct bus_usage *u);
+
+enum capture_dir {
+	CAPTURE_RX,
+	CAPTURE_TX,
+};
+
+/* Raw bus traffic, with timestamps, as stored in a capture file */
+struct capture {
+	FILE *f;
+	uint64_t time_us;
+};
+
+struct capture_record {
+	uint64_t time_us;
+	uint8_t dir;
+	uint8_t len;
+	uint8_t data[255];
+};
 
-extern const struct device_ops jxi_heater_ops;
+int capture_create(struct capture *c, const char *path, uint64_t now_us);
+void capture_write(struct capture *c, uint64_t now_us, int dir,
+		   const uint8_t *buf, size_t len);
+void capture_flush(struct capture *c);
+int capture_open(struct capture *c, const char *path);
+int capture_read(struct capture *c, struct capture_record *rec);
+void capture_close(struct capture *c);
 
 static inline uint16_t read16_le(const uint8_t *raw)
 {
@@ -7,6 +7,7 @@
 #include "aqualink-internal.h"
 
 #include <errno.h>
+#include <stdbool.h>
 #include <string.h>
 
 static const uint8_t aq_header[] = {0x10, 0x02};
@@ -43,7 +44,46 @@ size_t aqualink_msg_to_frame(uint8_t *dest, const uint8_t *msg, size_t len)
 	return dest - dest_start;
 }
 
-int aqualink_frame_to_msg(uint8_t *dest, const uint8_t *frame, size_t len)
+/*
+ * Frames the 'len' byte message at 'buf + 2', without copying it elsewhere
+ * first. 'buf' must hold AQUALINK_FRAME_CAPACITY(len) bytes. The payload is
+ * escaped back to front, so that no byte is overwritten before it has moved.
+ */
+size_t aqualink_frame_in_place(uint8_t *buf, size_t len)
+{
+	const uint8_t *msg = buf + sizeof(aq_header);
+	size_t i, pos, end;
+	uint8_t sum;
+
+	memcpy(buf, aq_header, sizeof(aq_header));
+	sum = mod256_sum(buf, sizeof(aq_header) + len);
+
+	pos = sizeof(aq_header) + len;
+	for (i = 0; i < len; i++)
+		pos += msg[i] == 0x10;
+
+	end = pos;
+	buf[end++] = sum;
+	if (sum == 0x10)
+		buf[end++] = 0x00;
+	memcpy(buf + end, aq_footer, sizeof(aq_footer));
+	end += sizeof(aq_footer);
+
+	for (i = len; i-- > 0; ) {
+		if (msg[i] == 0x10)
+			buf[--pos] = 0x00;
+		buf[--pos] = msg[i];
+	}
+
+	return end;
+}
+
+/*
+ * Reference decoder, kept as a known-good baseline for the single-pass decoder
+ * below. It makes separate passes for the footer, header, unescaping and the
+ * checksum.
+ */
+int aqualink_frame_to_msg_ref(uint8_t *dest, const uint8_t *frame, size_t len)
 {
 	uint8_t calculated_sum, raw_sum;
 
@@ -72,25 +112,339 @@ int aqualink_frame_to_msg(uint8_t *dest, const uint8_t *frame, size_t len)
 	return len - 1;
 }
 
+enum aq_byte_class {
+	AQ_BYTE_OTHER,
+	AQ_BYTE_NUL,
+	AQ_BYTE_STX,
+	AQ_BYTE_ETX,
+	AQ_BYTE_DLE,
+	AQ_NUM_BYTE_CLASSES,
+};
+
+enum aq_dec_action {
+	AQ_ACT_NONE,
+	AQ_ACT_JUNK,
+	AQ_ACT_JUNK2,
+	AQ_ACT_STORE,
+	AQ_ACT_STORE_DLE,
+	AQ_ACT_RESTART,
+	AQ_ACT_END,
+	AQ_ACT_ERROR,
+	AQ_ACT_OVERFLOW,
+};
+
+struct aq_dec_transition {
+	uint8_t next;
+	uint8_t action;
+};
+
+static const uint8_t aq_byte_class[256] = {
+	[0x00] = AQ_BYTE_NUL,
+	[0x02] = AQ_BYTE_STX,
+	[0x03] = AQ_BYTE_ETX,
+	[0x10] = AQ_BYTE_DLE,
+};
+
+#define AQ_DEC_ERROR	{ AQ_DEC_HDR_DLE, AQ_ACT_ERROR }
+#define AQ_DEC_STORE	{ AQ_DEC_DATA, AQ_ACT_STORE }
+#define AQ_DEC_JUNK	{ AQ_DEC_HUNT, AQ_ACT_JUNK }
+#define AQ_DEC_JUNK2	{ AQ_DEC_HUNT, AQ_ACT_JUNK2 }
+
+/*
+ * Every byte of a frame is handled by exactly one lookup in this table,
+ * indexed by the current state and the class of the byte. The HUNT states are
+ * only entered by the stream parser, which has to find frames among junk.
+ */
+static const struct aq_dec_transition
+aq_dec_table[AQ_DEC_NUM_STATES][AQ_NUM_BYTE_CLASSES] = {
+	[AQ_DEC_HUNT] = {
+		[AQ_BYTE_OTHER] = AQ_DEC_JUNK,
+		[AQ_BYTE_NUL] = AQ_DEC_JUNK,
+		[AQ_BYTE_STX] = AQ_DEC_JUNK,
+		[AQ_BYTE_ETX] = AQ_DEC_JUNK,
+		[AQ_BYTE_DLE] = { AQ_DEC_HUNT_STX, AQ_ACT_NONE },
+	},
+	[AQ_DEC_HUNT_STX] = {
+		/* Both the pending 0x10 and this byte are junk. */
+		[AQ_BYTE_OTHER] = AQ_DEC_JUNK2,
+		[AQ_BYTE_NUL] = AQ_DEC_JUNK2,
+		[AQ_BYTE_STX] = { AQ_DEC_DATA, AQ_ACT_NONE },
+		[AQ_BYTE_ETX] = AQ_DEC_JUNK2,
+		/* Only the pending 0x10 is junk. This one may start a header. */
+		[AQ_BYTE_DLE] = { AQ_DEC_HUNT_STX, AQ_ACT_JUNK },
+	},
+	[AQ_DEC_HDR_DLE] = {
+		[AQ_BYTE_OTHER] = AQ_DEC_ERROR,
+		[AQ_BYTE_NUL] = AQ_DEC_ERROR,
+		[AQ_BYTE_STX] = AQ_DEC_ERROR,
+		[AQ_BYTE_ETX] = AQ_DEC_ERROR,
+		[AQ_BYTE_DLE] = { AQ_DEC_HDR_STX, AQ_ACT_NONE },
+	},
+	[AQ_DEC_HDR_STX] = {
+		[AQ_BYTE_OTHER] = AQ_DEC_ERROR,
+		[AQ_BYTE_NUL] = AQ_DEC_ERROR,
+		[AQ_BYTE_STX] = { AQ_DEC_DATA, AQ_ACT_NONE },
+		[AQ_BYTE_ETX] = AQ_DEC_ERROR,
+		[AQ_BYTE_DLE] = AQ_DEC_ERROR,
+	},
+	[AQ_DEC_DATA] = {
+		[AQ_BYTE_OTHER] = AQ_DEC_STORE,
+		[AQ_BYTE_NUL] = AQ_DEC_STORE,
+		[AQ_BYTE_STX] = AQ_DEC_STORE,
+		[AQ_BYTE_ETX] = AQ_DEC_STORE,
+		[AQ_BYTE_DLE] = { AQ_DEC_DLE, AQ_ACT_NONE },
+	},
+	[AQ_DEC_DLE] = {
+		[AQ_BYTE_OTHER] = AQ_DEC_ERROR,
+		[AQ_BYTE_NUL] = { AQ_DEC_DATA, AQ_ACT_STORE_DLE },
+		/* A new header in the middle of a frame. Start over. */
+		[AQ_BYTE_STX] = { AQ_DEC_DATA, AQ_ACT_RESTART },
+		[AQ_BYTE_ETX] = { AQ_DEC_HDR_DLE, AQ_ACT_END },
+		[AQ_BYTE_DLE] = AQ_DEC_ERROR,
+	},
+};
+
+void aqualink_decoder_init(struct aqualink_decoder *dec, uint8_t *dest,
+			   size_t size)
+{
+	dec->dest = dest;
+	dec->size = size;
+	dec->len = 0;
+	dec->sum = 0;
+	dec->state = AQ_DEC_HDR_DLE;
+}
+
+/* Advance the decoder by one byte, and return the action that was taken. */
+static inline int aq_dec_step(struct aqualink_decoder *dec, uint8_t byte)
+{
+	const struct aq_dec_transition *tr;
+
+	tr = &aq_dec_table[dec->state][aq_byte_class[byte]];
+	dec->state = tr->next;
+
+	switch (tr->action) {
+	case AQ_ACT_STORE_DLE:
+		byte = 0x10;
+		/* fallthrough */
+	case AQ_ACT_STORE:
+		if (dec->len >= dec->size)
+			return AQ_ACT_OVERFLOW;
+
+		dec->dest[dec->len++] = byte;
+		dec->sum += byte;
+		return AQ_ACT_STORE;
+	case AQ_ACT_RESTART:
+		dec->len = 0;
+		dec->sum = 0;
+		return AQ_ACT_RESTART;
+	default:
+		return tr->action;
+	}
+}
+
+static int aqualink_decoder_finish(struct aqualink_decoder *dec)
+{
+	uint8_t raw_sum, calculated_sum;
+
+	if (!dec->len)
+		return -EINVAL;
+
+	/* The running sum includes the checksum byte itself. Take it out. */
+	raw_sum = dec->dest[dec->len - 1];
+	calculated_sum = dec->sum - raw_sum + mod256_sum(aq_header, 2);
+	if (calculated_sum != raw_sum)
+		return -EPROTO;
+
+	return dec->len - 1;
+}
+
+/* Returns a message length or error if 'action' ended the frame, else 0. */
+static int aq_dec_frame_result(struct aqualink_decoder *dec, int action,
+			       int *ret)
+{
+	switch (action) {
+	case AQ_ACT_END:
+		*ret = aqualink_decoder_finish(dec);
+		break;
+	case AQ_ACT_ERROR:
+		*ret = -EINVAL;
+		break;
+	case AQ_ACT_OVERFLOW:
+		*ret = -E2BIG;
+		break;
+	default:
+		return 0;
+	}
+
+	dec->len = 0;
+	dec->sum = 0;
+	return 1;
+}
+
+int aqualink_decoder_feed(struct aqualink_decoder *dec, const uint8_t *buf,
+			  size_t len, size_t *consumed)
+{
+	size_t i;
+	int ret;
+
+	for (i = 0; i < len; i++) {
+		if (!aq_dec_frame_result(dec, aq_dec_step(dec, buf[i]), &ret))
+			continue;
+
+		/* The frame is over, one way or another. */
+		dec->state = AQ_DEC_HDR_DLE;
+		*consumed = i + 1;
+		return ret;
+	}
+
+	*consumed = len;
+	return -EAGAIN;
+}
+
+void aqualink_parser_init(struct aqualink_parser *p, aqualink_msg_cb msg_cb)
+{
+	memset(p, 0, sizeof(*p));
+	aqualink_decoder_init(&p->dec, p->msg, sizeof(p->msg));
+	p->dec.state = AQ_DEC_HUNT;
+	p->msg_cb = msg_cb;
+}
+
+/*
+ * Parse a chunk of the byte stream. Work is proportional to 'len', as the
+ * parser state carries over between calls. 'msg_cb' is called for every
+ * frame that ends in the chunk, with a negative 'len' for bad frames.
+ */
+void aqualink_parser_feed(struct aqualink_parser *p, const uint8_t *buf,
+			  size_t len)
+{
+	struct aqualink_decoder *dec = &p->dec;
+	bool in_frame;
+	size_t i;
+	int action, ret;
+
+	for (i = 0; i < len; i++) {
+		in_frame = dec->state >= AQ_DEC_DATA;
+		action = aq_dec_step(dec, buf[i]);
+
+		/* Raw length on the wire, counted from the header. */
+		if (in_frame)
+			p->frame_len++;
+		else if (dec->state == AQ_DEC_DATA)
+			p->frame_len = 2;
+
+		switch (action) {
+		case AQ_ACT_JUNK:
+			p->junk_bytes++;
+			continue;
+		case AQ_ACT_JUNK2:
+			p->junk_bytes += 2;
+			continue;
+		case AQ_ACT_RESTART:
+			p->resyncs++;
+			p->frame_len = 2;
+			continue;
+		}
+
+		if (!aq_dec_frame_result(dec, action, &ret))
+			continue;
+
+		if (ret >= 0) {
+			p->frames++;
+			dec->state = AQ_DEC_HUNT;
+		} else if (action == AQ_ACT_END) {
+			p->errors++;
+			dec->state = AQ_DEC_HUNT;
+		} else {
+			/* Lost sync mid-frame. A 0x10 may start the next one. */
+			p->resyncs++;
+			p->errors++;
+			dec->state = buf[i] == 0x10 ? AQ_DEC_HUNT_STX : AQ_DEC_HUNT;
+		}
+
+		p->msg_cb(p, p->msg, ret);
+	}
+}
+
+/*
+ * Decode a complete frame in a single forward pass. 'dest' may be the same
+ * buffer as 'frame'. It accepts the same frames as the stream decoder, but
+ * goes from one 0x10 to the next with memchr(), copying and summing the runs
+ * in between in bulk, as escapes are rare on a real bus.
+ */
+int aqualink_frame_to_msg(uint8_t *dest, const uint8_t *frame, size_t len)
+{
+	const uint8_t *src = frame + sizeof(aq_header);
+	const uint8_t *const end = frame + len;
+	const uint8_t *dle;
+	uint8_t raw_sum, sum = 0;
+	size_t run, out = 0;
+
+	if (len < sizeof(aq_header) + sizeof(aq_footer) ||
+	    memcmp(frame, aq_header, sizeof(aq_header)))
+		return -EINVAL;
+
+	for (;;) {
+		dle = memchr(src, 0x10, end - src);
+		if (!dle || dle + 1 == end)
+			return -EINVAL;
+
+		/* Summed first, as the copy may overwrite it in place. */
+		run = dle - src;
+		sum += mod256_sum(src, run);
+		memmove(dest + out, src, run);
+		out += run;
+		src = dle + 2;
+
+		switch (dle[1]) {
+		case 0x00:
+			dest[out++] = 0x10;
+			sum += 0x10;
+			continue;
+		case 0x02:
+			/* A new header in the middle of a frame. Start over. */
+			out = 0;
+			sum = 0;
+			continue;
+		case 0x03:
+			break;
+		default:
+			return -EINVAL;
+		}
+
+		break;
+	}
+
+	if (!out)
+		return -EINVAL;
+
+	/* The sum includes the checksum byte itself. Take it out. */
+	raw_sum = dest[out - 1];
+	if ((uint8_t)(sum - raw_sum + mod256_sum(aq_header, 2)) != raw_sum)
+		return -EPROTO;
+
+	/* Nothing may follow the footer. */
+	return src == end ? (int)out - 1 : -EINVAL;
+}
+
 static void *memfind(const uint8_t *buf, size_t len, const uint8_t needle[2])
 {
 	const uint8_t *next;
 	uint8_t *start;
 
-	if (len <= 1)
-		return NULL;
-
-	do {
+	/* The last byte can't start a match, so 'len' stays above 0. */
+	while (len > 1) {
 		start = memchr(buf, needle[0], len - 1);
-		if (start && start[1] == needle[1])
-			break;
+		if (!start)
+			return NULL;
+		if (start[1] == needle[1])
+			return start;
 
 		next = start + 1;
-		len -= (ptrdiff_t)(next - buf);
+		len -= next - buf;
 		buf = next;
-	} while(start);
+	}
 
-	return start;
+	return NULL;
 }
 
 /*
@@ -123,7 +477,7 @@ size_t aqualink_unpack(uint8_t *dest, const uint8_t *buf, size_t len)
 
 	while (src < end) {
 		len = end - src;
-		next = memfind(src + 1, len - 1, escape_seq);
+		next = memfind(src, len, escape_seq);
 		move_len = next ? ((next - src) + 1) : len;
 
 		memmove(dest, src, move_len);
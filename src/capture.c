@@ -0,0 +1,136 @@
+/*
+ * Bus capture files
+ *
+ * Every chunk of bytes sent or received on the bus is stored as one record:
+ *
+ *	delta_us (4, LE) | dir (1) | len (1) | data (len)
+ *
+ * 'delta_us' is the time since the previous record, or since the capture was
+ * started for the first record. The file starts with the magic "AQCP" and a
+ * version byte.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "aqualink-internal.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+static const uint8_t capture_magic[] = { 'A', 'Q', 'C', 'P', 1 };
+
+static void write32_le(uint8_t *raw, uint32_t val)
+{
+	raw[0] = val;
+	raw[1] = val >> 8;
+	raw[2] = val >> 16;
+	raw[3] = val >> 24;
+}
+
+static uint32_t read32_le(const uint8_t *raw)
+{
+	return (uint32_t)read16_le(raw + 2) << 16 | read16_le(raw);
+}
+
+int capture_create(struct capture *c, const char *path, uint64_t now_us)
+{
+	c->f = fopen(path, "wb");
+	if (!c->f)
+		return -errno;
+
+	if (fwrite(capture_magic, sizeof(capture_magic), 1, c->f) != 1) {
+		fclose(c->f);
+		c->f = NULL;
+		return -EIO;
+	}
+
+	c->time_us = now_us;
+	return 0;
+}
+
+void capture_write(struct capture *c, uint64_t now_us, int dir,
+		   const uint8_t *buf, size_t len)
+{
+	uint8_t hdr[6];
+	uint64_t delta;
+	size_t chunk;
+
+	if (!c->f)
+		return;
+
+	while (len) {
+		chunk = len > 255 ? 255 : len;
+		delta = now_us - c->time_us;
+
+		write32_le(hdr, delta > UINT32_MAX ? UINT32_MAX : delta);
+		hdr[4] = dir;
+		hdr[5] = chunk;
+		fwrite(hdr, sizeof(hdr), 1, c->f);
+		fwrite(buf, chunk, 1, c->f);
+
+		c->time_us = now_us;
+		buf += chunk;
+		len -= chunk;
+	}
+}
+
+/* Records are buffered until this, or capture_close(), is called. */
+void capture_flush(struct capture *c)
+{
+	if (c->f)
+		fflush(c->f);
+}
+
+int capture_open(struct capture *c, const char *path)
+{
+	uint8_t magic[sizeof(capture_magic)];
+
+	c->f = fopen(path, "rb");
+	if (!c->f)
+		return -errno;
+
+	if (fread(magic, sizeof(magic), 1, c->f) != 1 ||
+	    memcmp(magic, capture_magic, sizeof(magic))) {
+		fclose(c->f);
+		c->f = NULL;
+		return -EINVAL;
+	}
+
+	c->time_us = 0;
+	return 0;
+}
+
+/*
+ * Returns 1 when 'rec' was filled in, 0 at the end of the capture, or a
+ * negative error for a truncated file. 'rec->time_us' counts from the start
+ * of the capture.
+ */
+int capture_read(struct capture *c, struct capture_record *rec)
+{
+	uint8_t hdr[6];
+	size_t n;
+
+	/* Only running out between records is the end of the capture. */
+	n = fread(hdr, 1, sizeof(hdr), c->f);
+	if (n != sizeof(hdr))
+		return !n && feof(c->f) ? 0 : -EIO;
+
+	c->time_us += read32_le(hdr);
+	rec->time_us = c->time_us;
+	rec->dir = hdr[4];
+	rec->len = hdr[5];
+
+	if (rec->len && fread(rec->data, rec->len, 1, c->f) != 1)
+		return -EIO;
+
+	return 1;
+}
+
+void capture_close(struct capture *c)
+{
+	if (c->f)
+		fclose(c->f);
+
+	c->f = NULL;
+}
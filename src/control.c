@@ -0,0 +1,281 @@
+/*
+ * Control socket - line based command interface on a unix socket
+ *
+ * Each line received from a client is split into words. The first word
+ * selects a command registered with control_register(). Replies end with a
+ * line reading "OK", or "ERROR <reason>".
+ *
+ * After "subscribe [interval_ms]", a client gets the state of all devices,
+ * then again whenever it changes, as lines ending with "EVENT <generation>".
+ * Changes in between are merged, and at most one event is sent per interval.
+ * Clients that do not read their events are skipped, and eventually dropped,
+ * so that they cannot hold up the bus.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "aqualink-internal.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <libubox/ulog.h>
+#include <libubox/usock.h>
+#include <libubox/ustream.h>
+#include <libubox/utils.h>
+
+#define CONTROL_MAX_LINE	256
+#define CONTROL_MAX_ARGS	8
+#define CONTROL_MIN_INTERVAL_MS	100
+/* Unsent output past which events are skipped, or the client dropped */
+#define CONTROL_SLOW_BYTES	4096
+#define CONTROL_DROP_BYTES	(64 * 1024)
+
+struct control_client {
+	struct ustream_fd stream;
+	struct list_head list;
+	/* Event delivery, for subscribed clients */
+	struct uloop_timeout publish;
+	uint64_t next_event_us;
+	uint64_t seen_gen;
+	unsigned int interval_ms;
+	bool subscribed;
+};
+
+static struct uloop_fd control_server;
+static LIST_HEAD(control_cmds);
+static LIST_HEAD(control_clients);
+static control_publish_cb control_publisher;
+static uint64_t control_gen;
+
+void control_register(struct control_cmd *cmd)
+{
+	list_add_tail(&cmd->list, &control_cmds);
+}
+
+static int control_help(struct ustream *out)
+{
+	struct control_cmd *cmd;
+
+	list_for_each_entry(cmd, &control_cmds, list)
+		ustream_printf(out, "%s %s\n", cmd->name, cmd->help);
+
+	return 0;
+}
+
+static int control_subscribe(struct control_cmd *cmd, struct ustream *out,
+			     int argc, char **argv)
+{
+	struct control_client *cl = container_of(out, struct control_client,
+						 stream.stream);
+	unsigned long interval_ms = 1000;
+
+	if (argc > 1)
+		interval_ms = strtoul(argv[1], NULL, 0);
+
+	if (interval_ms < CONTROL_MIN_INTERVAL_MS)
+		return -EINVAL;
+
+	cl->interval_ms = interval_ms;
+	cl->subscribed = true;
+	cl->next_event_us = monotonic_us() + interval_ms * 1000ull;
+	uloop_timeout_cancel(&cl->publish);
+
+	/* Changes are only meaningful on top of the full picture. */
+	if (control_publisher)
+		control_publisher(out, 0);
+	ustream_printf(out, "EVENT %llu\n", (unsigned long long)control_gen);
+	cl->seen_gen = control_gen;
+
+	return 0;
+}
+
+static struct control_cmd control_subscribe_cmd = {
+	.name = "subscribe",
+	.help = "[interval_ms] - push state changes",
+	.handler = control_subscribe,
+};
+
+static int control_dispatch(struct ustream *out, int argc, char **argv)
+{
+	struct control_cmd *cmd;
+
+	if (!strcmp(argv[0], "help"))
+		return control_help(out);
+
+	list_for_each_entry(cmd, &control_cmds, list) {
+		if (!strcmp(cmd->name, argv[0]))
+			return cmd->handler(cmd, out, argc, argv);
+	}
+
+	return -EOPNOTSUPP;
+}
+
+static void control_handle_line(struct ustream *out, char *line)
+{
+	char *argv[CONTROL_MAX_ARGS], *saveptr;
+	int argc = 0, ret;
+
+	for (argv[0] = strtok_r(line, " \t\r", &saveptr);
+	     argv[argc] && argc < CONTROL_MAX_ARGS - 1;
+	     argv[argc] = strtok_r(NULL, " \t\r", &saveptr))
+		argc++;
+
+	/* Empty lines are ignored, which makes 'nc' sessions pleasant. */
+	if (!argc)
+		return;
+
+	ret = control_dispatch(out, argc, argv);
+	if (ret < 0)
+		ustream_printf(out, "ERROR %s\n", strerror(-ret));
+	else
+		ustream_printf(out, "OK\n");
+}
+
+static void control_client_free(struct control_client *cl)
+{
+	uloop_timeout_cancel(&cl->publish);
+	list_del(&cl->list);
+	ustream_free(&cl->stream.stream);
+	close(cl->stream.fd.fd);
+	free(cl);
+}
+
+static void control_notify_read(struct ustream *s, int bytes)
+{
+	char line[CONTROL_MAX_LINE], *buf, *eol;
+	int len;
+
+	while ((buf = ustream_get_read_buf(s, &len))) {
+		eol = memchr(buf, '\n', len);
+		if (!eol) {
+			/* Nobody sends lines this long. Drop the junk. */
+			if (len >= sizeof(line))
+				ustream_consume(s, len);
+			return;
+		}
+
+		len = eol - buf;
+		if (len >= sizeof(line))
+			len = sizeof(line) - 1;
+
+		memcpy(line, buf, len);
+		line[len] = '\0';
+		ustream_consume(s, eol - buf + 1);
+
+		control_handle_line(s, line);
+	}
+}
+
+static void control_notify_state(struct ustream *s)
+{
+	struct control_client *cl = container_of(s, struct control_client,
+						 stream.stream);
+
+	if (!s->eof && !s->write_error)
+		return;
+
+	control_client_free(cl);
+}
+
+static void control_publish_timeout(struct uloop_timeout *t)
+{
+	struct control_client *cl = container_of(t, struct control_client,
+						 publish);
+	struct ustream *out = &cl->stream.stream;
+	uint64_t now = monotonic_us();
+	int pending;
+
+	if (!control_publisher || cl->seen_gen == control_gen)
+		return;
+
+	if (now < cl->next_event_us) {
+		uloop_timeout_set(t, (cl->next_event_us - now + 999) / 1000);
+		return;
+	}
+
+	cl->next_event_us = now + cl->interval_ms * 1000ull;
+
+	/* Changes keep piling up in 'seen_gen' until the client catches up. */
+	pending = ustream_pending_data(out, true);
+	if (pending > CONTROL_DROP_BYTES) {
+		ULOG_WARN("Dropping control client, %d bytes unread\n",
+			  pending);
+		control_client_free(cl);
+		return;
+	}
+
+	if (pending > CONTROL_SLOW_BYTES) {
+		uloop_timeout_set(t, cl->interval_ms);
+		return;
+	}
+
+	control_publisher(out, cl->seen_gen);
+	ustream_printf(out, "EVENT %llu\n", (unsigned long long)control_gen);
+	cl->seen_gen = control_gen;
+}
+
+void control_set_publisher(control_publish_cb cb)
+{
+	control_publisher = cb;
+}
+
+void control_publish(uint64_t gen)
+{
+	struct control_client *cl;
+
+	control_gen = gen;
+
+	list_for_each_entry(cl, &control_clients, list) {
+		if (cl->subscribed && !cl->publish.pending)
+			uloop_timeout_set(&cl->publish, 0);
+	}
+}
+
+static void control_accept(struct uloop_fd *fd, unsigned int events)
+{
+	struct control_client *cl;
+	int sock;
+
+	sock = accept(fd->fd, NULL, NULL);
+	if (sock < 0)
+		return;
+
+	cl = calloc(1, sizeof(*cl));
+	if (!cl) {
+		close(sock);
+		return;
+	}
+
+	cl->stream.stream.string_data = true;
+	cl->stream.stream.notify_read = control_notify_read;
+	cl->stream.stream.notify_state = control_notify_state;
+	cl->publish.cb = control_publish_timeout;
+	ustream_fd_init(&cl->stream, sock);
+	list_add_tail(&cl->list, &control_clients);
+}
+
+int control_init(const char *path)
+{
+	int sock;
+
+	/* A socket left behind by an earlier instance would make bind fail. */
+	unlink(path);
+
+	sock = usock(USOCK_UNIX | USOCK_SERVER | USOCK_NONBLOCK, path, NULL);
+	if (sock < 0) {
+		ULOG_ERR("%s: cannot create control socket: %s\n", path,
+			 strerror(errno));
+		return -errno;
+	}
+
+	control_server.fd = sock;
+	control_server.cb = control_accept;
+	uloop_fd_add(&control_server, ULOOP_READ);
+	control_register(&control_subscribe_cmd);
+
+	return 0;
+}
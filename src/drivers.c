@@ -0,0 +1,20 @@
+/*
+ * Device driver registry
+ *
+ * Every bus is populated with a device for each address of each driver here.
+ * Devices that are not present back off their probes, so listing a driver
+ * costs little on sites without that equipment. Address ranges must not
+ * overlap.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "aqualink-internal.h"
+
+#include <libubox/utils.h>
+
+const struct device_driver *const aqua_drivers[] = {
+	&jxi_heater_driver,
+};
+
+const size_t aqua_num_drivers = ARRAY_SIZE(aqua_drivers);
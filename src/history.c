@@ -0,0 +1,238 @@
+/*
+ * Per-device history of measurements, in a ring file
+ *
+ * The file is a fixed size header followed by 'capacity' samples, and is
+ * mapped into memory. Samples are in host byte order, as the file is only
+ * meant to be read back by the daemon that wrote it. Once the ring is full,
+ * the oldest samples are overwritten.
+ *
+ * New samples are held back in a small batch, and only copied into the map
+ * once the batch is full, so that flash is written to every few minutes at
+ * most, rather than on every poll.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "aqualink-internal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define HISTORY_MAGIC		0x53485141	/* "AQHS" */
+#define HISTORY_VERSION		1
+
+struct history_file {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t sample_size;
+	uint32_t capacity;
+	/* Where the next sample goes, and how many there are */
+	uint32_t head;
+	uint32_t count;
+	struct history_sample samples[];
+};
+
+static bool history_file_valid(const struct history_file *f, size_t len,
+			       uint32_t capacity)
+{
+	return len == sizeof(*f) + capacity * sizeof(f->samples[0]) &&
+	       f->magic == HISTORY_MAGIC && f->version == HISTORY_VERSION &&
+	       f->sample_size == sizeof(f->samples[0]) &&
+	       f->capacity == capacity && f->head < capacity &&
+	       f->count <= capacity;
+}
+
+static const struct history_sample *history_newest(const struct history *h)
+{
+	const struct history_file *f = h->map;
+
+	if (h->num_pending)
+		return &h->pending[h->num_pending - 1];
+	if (!f->count)
+		return NULL;
+
+	return &f->samples[(f->head + f->capacity - 1) % f->capacity];
+}
+
+/* Makes sure every block of the file is allocated */
+static int history_reserve(int fd, size_t len)
+{
+	uint8_t buf[4096];
+	size_t off;
+	ssize_t n;
+	int ret;
+
+	ret = posix_fallocate(fd, 0, len);
+	if (ret != EOPNOTSUPP && ret != EINVAL)
+		return -ret;
+
+	/*
+	 * Not all filesystems can, jffs2 for one. Writing back what is there
+	 * allocates the holes, which read as zeros, and keeps the samples.
+	 */
+	for (off = 0; off < len; off += n) {
+		n = pread(fd, buf, len - off < sizeof(buf) ? len - off :
+			  sizeof(buf), off);
+		if (n < 0)
+			return -errno;
+		if (!n)
+			return -EIO;
+
+		ret = pwrite(fd, buf, n, off);
+		if (ret < 0)
+			return -errno;
+		/* Short of space, most likely, though errno does not say */
+		if (ret != n)
+			return -EIO;
+	}
+
+	return 0;
+}
+
+/*
+ * Opens the ring at 'path', keeping the samples already in it if it has the
+ * same layout, or starting over otherwise. At most one sample is kept every
+ * 'interval_s' seconds.
+ */
+int history_open(struct history *h, const char *path, uint32_t capacity,
+		 uint32_t interval_s)
+{
+	size_t len = sizeof(struct history_file) +
+		     capacity * sizeof(struct history_sample);
+	const struct history_sample *newest;
+	struct history_file *f;
+	struct stat st;
+	int fd, ret;
+
+	memset(h, 0, sizeof(*h));
+	if (!capacity)
+		return -EINVAL;
+
+	fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+		return -errno;
+
+	if (fstat(fd, &st) < 0 ||
+	    ((size_t)st.st_size != len && ftruncate(fd, len) < 0)) {
+		ret = -errno;
+		close(fd);
+		return ret;
+	}
+
+	/* A full disk must fail here, not as SIGBUS on a store to the map. */
+	ret = history_reserve(fd, len);
+	if (ret < 0) {
+		close(fd);
+		return ret;
+	}
+
+	f = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	ret = -errno;
+	close(fd);
+	if (f == MAP_FAILED)
+		return ret;
+
+	if (!history_file_valid(f, (size_t)st.st_size, capacity)) {
+		memset(f, 0, sizeof(*f));
+		f->magic = HISTORY_MAGIC;
+		f->version = HISTORY_VERSION;
+		f->sample_size = sizeof(f->samples[0]);
+		f->capacity = capacity;
+	}
+
+	h->map = f;
+	h->map_len = len;
+	h->interval_s = interval_s;
+
+	/* Don't sample again too soon after a restart. */
+	newest = history_newest(h);
+	if (newest)
+		h->last_s = newest->time_s;
+
+	return 0;
+}
+
+/* Moves the batch into the ring. The kernel writes it out in the background. */
+void history_flush(struct history *h)
+{
+	struct history_file *f = h->map;
+	unsigned int i;
+
+	if (!f || !h->num_pending)
+		return;
+
+	for (i = 0; i < h->num_pending; i++) {
+		f->samples[f->head] = h->pending[i];
+		f->head = (f->head + 1) % f->capacity;
+		if (f->count < f->capacity)
+			f->count++;
+	}
+
+	h->num_pending = 0;
+	msync(f, h->map_len, MS_ASYNC);
+}
+
+void history_add(struct history *h, uint32_t now_s, const int32_t *values)
+{
+	struct history_sample *s;
+
+	if (!h->map)
+		return;
+
+	/* A clock stepped back would otherwise stop sampling for a while. */
+	if (h->last_s && now_s >= h->last_s && now_s - h->last_s < h->interval_s)
+		return;
+
+	s = &h->pending[h->num_pending++];
+	s->time_s = now_s;
+	memcpy(s->values, values, sizeof(s->values));
+	h->last_s = now_s;
+
+	if (h->num_pending == HISTORY_BATCH)
+		history_flush(h);
+}
+
+/*
+ * Calls 'cb' for every sample taken from 'from_s' to 'to_s', inclusive,
+ * oldest first, including those not yet flushed. Returns how many there were.
+ */
+size_t history_query(const struct history *h, uint32_t from_s, uint32_t to_s,
+		     history_cb cb, void *priv)
+{
+	const struct history_file *f = h->map;
+	const struct history_sample *s;
+	size_t i, n = 0;
+
+	if (!f)
+		return 0;
+
+	for (i = 0; i < f->count + h->num_pending; i++) {
+		if (i < f->count)
+			s = &f->samples[(f->head + f->capacity - f->count + i) %
+					f->capacity];
+		else
+			s = &h->pending[i - f->count];
+
+		if (s->time_s < from_s || s->time_s > to_s)
+			continue;
+
+		cb(s, priv);
+		n++;
+	}
+
+	return n;
+}
+
+void history_close(struct history *h)
+{
+	if (!h->map)
+		return;
+
+	history_flush(h);
+	munmap(h->map, h->map_len);
+	h->map = NULL;
+}
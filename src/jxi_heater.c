@@ -1,7 +1,11 @@
 #include "aqualink-internal.h"
 
 #include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <libubox/ulog.h>
+#include <libubox/ustream.h>
 #include <libubox/utils.h>
 
 enum jxi_commands {
@@ -10,26 +14,339 @@ enum jxi_commands {
 	JXI_GET_MEASUREMENTS = 0x25,
 };
 
+enum jxi_status_flags {
+	JXI_STATUS_HEATING = 0x08,
+	JXI_STATUS_REMOTE_DISABLED = 0x10,
+};
+
+enum jxi_error_flags {
+	JXI_ERROR_NO_IGNITION = 0x08,
+};
+
+/* Last readings from the heater. Timestamps are 0 until first received. */
+struct jxi_state {
+	uint64_t status_us;
+	uint8_t status;
+	uint8_t unknown;
+	uint8_t errors;
+
+	uint64_t measured_us;
+	uint16_t gv_on_hours;
+	uint16_t cycles;
+	int temperature;
+};
+
+/* Arguments of JXI_COMMAND: flags, pool and spa setpoints, external temp */
+#define JXI_COMMAND_ARGS	4
+/* The heater is switched off unless "heater on" is repeated this often. */
+#define JXI_KEEPALIVE_TIMEOUT_S	1800
+/*
+ * The heater drops out of remote control when it stops hearing commands, so
+ * the last one is repeated, as the Python tool did, every few seconds. Rounds
+ * with a repeat are urgent, so neither polls nor probes of other devices go
+ * ahead of them.
+ */
+#define JXI_REFRESH_MS		3000
+
+/*
+ * Control requests are not queued. The driver keeps the state the heater
+ * should be in, and builds the command from it when given a bus slot, so
+ * any number of changes in between go out as one frame. The command is sent
+ * again until a reply acknowledges the exact state that was sent.
+ */
+struct jxi_heater {
+	struct device dev;
+	struct jxi_state state;
+	struct ratelimit no_ignition_log;
+
+	uint8_t desired[JXI_COMMAND_ARGS];
+	uint8_t sent[JXI_COMMAND_ARGS];
+	uint8_t acked[JXI_COMMAND_ARGS];
+	bool have_desired;
+	bool have_acked;
+	/* Changed since last sent, so the command is urgent */
+	bool changed;
+	/* A command is outstanding, and 'sent' is what it contained */
+	bool in_flight;
+	/* When the command was last handed to the bus */
+	uint64_t command_us;
+	/* The current round starts with the command, decided at its start */
+	bool round_command;
+
+	struct uloop_timeout keepalive;
+};
+
+static const struct device_ops jxi_heater_ops;
+
+static struct jxi_heater *to_jxi(struct device *dev)
+{
+	return container_of(dev, struct jxi_heater, dev);
+}
+
+static struct jxi_state *jxi_state(struct device *dev)
+{
+	return &to_jxi(dev)->state;
+}
+
+static bool jxi_control_pending(const struct jxi_heater *jxi)
+{
+	if (!jxi->have_desired)
+		return false;
+
+	return !jxi->have_acked ||
+	       memcmp(jxi->desired, jxi->acked, sizeof(jxi->desired));
+}
+
+static bool jxi_refresh_due(const struct jxi_heater *jxi, uint64_t now_us)
+{
+	return jxi->have_desired &&
+	       now_us >= jxi->command_us + JXI_REFRESH_MS * 1000ULL;
+}
+
+/* 0xe0 to 0xff are negative in two's complement, 0x00 to 0xdf positive. */
+static int jxi_encode_temperature(int temp, uint8_t *raw)
+{
+	if (temp < -0x20 || temp >= 0xe0)
+		return -ERANGE;
+
+	*raw = temp;
+	return 0;
+}
+
+static int jxi_decode_temperature(uint8_t raw)
+{
+	return raw >= 0xe0 ? (int)raw - 0x100 : raw;
+}
+
+int jxi_heater_set_control(struct device *dev, const struct jxi_control *ctl)
+{
+	struct jxi_heater *jxi;
+	uint8_t args[JXI_COMMAND_ARGS];
+
+	if (dev->ops != &jxi_heater_ops)
+		return -ENODEV;
+
+	jxi = to_jxi(dev);
+	args[0] = ctl->flags & ~JXI_CTL_EXT_TEMP_VALID;
+	args[3] = 0xff;
+
+	if (jxi_encode_temperature(ctl->pool_setpoint, &args[1]) ||
+	    jxi_encode_temperature(ctl->spa_setpoint, &args[2]))
+		return -ERANGE;
+
+	if (!jxi->have_desired || memcmp(args, jxi->desired, sizeof(args))) {
+		memcpy(jxi->desired, args, sizeof(args));
+		jxi->have_desired = true;
+		jxi->changed = true;
+		dev_state_changed(dev);
+	}
+
+	if (!jxi_control_pending(jxi)) {
+		jxi->changed = false;
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Until told otherwise: pool at 20 °C, spa at 35 °C, and the heater off */
+static void jxi_get_control(const struct jxi_heater *jxi,
+			    struct jxi_control *ctl)
+{
+	if (!jxi->have_desired) {
+		ctl->flags = JXI_CTL_CELSIUS;
+		ctl->pool_setpoint = 20;
+		ctl->spa_setpoint = 35;
+		return;
+	}
+
+	ctl->flags = jxi->desired[0];
+	ctl->pool_setpoint = jxi_decode_temperature(jxi->desired[1]);
+	ctl->spa_setpoint = jxi_decode_temperature(jxi->desired[2]);
+}
+
+static void jxi_keepalive_expired(struct uloop_timeout *t)
+{
+	struct jxi_heater *jxi = container_of(t, struct jxi_heater, keepalive);
+	struct jxi_control ctl;
+
+	ULOG_WARN("Heater keepalive timed out! Shutting off!\n");
+
+	jxi_get_control(jxi, &ctl);
+	ctl.flags &= ~JXI_CTL_HEATER_ON;
+	/* Picked up at the next poll, which is never far away. */
+	jxi_heater_set_control(&jxi->dev, &ctl);
+}
+
+/*
+ * Setpoints are kept in Celsius, which is what the heater is told to use.
+ * Fahrenheit is converted, truncating toward zero.
+ */
+static int jxi_parse_temperature(const char *arg, int *temp)
+{
+	char *end;
+	long val;
+
+	val = strtol(arg, &end, 10);
+	if (end == arg)
+		return -EINVAL;
+
+	if (!strcmp(end, "F") || !strcmp(end, "f"))
+		val = (val - 32) * 5 / 9;
+	else if (strcmp(end, "C") && strcmp(end, "c"))
+		return -EINVAL;
+
+	*temp = val;
+	return 0;
+}
+
+/* "setpoint pool|spa <temp>C|F" */
+static int jxi_control_setpoint(struct jxi_heater *jxi, int argc, char **argv)
+{
+	struct jxi_control ctl;
+	int temp, ret;
+
+	if (argc != 3)
+		return -EINVAL;
+
+	ret = jxi_parse_temperature(argv[2], &temp);
+	if (ret)
+		return ret;
+
+	jxi_get_control(jxi, &ctl);
+	if (!strcmp(argv[1], "pool"))
+		ctl.pool_setpoint = temp;
+	else if (!strcmp(argv[1], "spa"))
+		ctl.spa_setpoint = temp;
+	else
+		return -EINVAL;
+
+	return jxi_heater_set_control(&jxi->dev, &ctl);
+}
+
+/* "heater [pool|spa|on|off]...": verbs are applied in order. */
+static int jxi_control_heater(struct jxi_heater *jxi, struct ustream *out,
+			      int argc, char **argv)
+{
+	struct jxi_control ctl;
+	bool turn_on = false;
+	int i;
+
+	jxi_get_control(jxi, &ctl);
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "pool")) {
+			ctl.flags &= ~JXI_CTL_SPA;
+			ctl.flags |= JXI_CTL_POOL;
+		} else if (!strcmp(argv[i], "spa")) {
+			ctl.flags &= ~JXI_CTL_POOL;
+			ctl.flags |= JXI_CTL_SPA;
+		} else if (!strcmp(argv[i], "on")) {
+			ctl.flags |= JXI_CTL_HEATER_ON;
+			turn_on = true;
+		} else if (!strcmp(argv[i], "off")) {
+			ctl.flags &= ~JXI_CTL_HEATER_ON;
+			turn_on = false;
+		} else {
+			return -EINVAL;
+		}
+	}
+
+	/* Each "on" pushes the automatic shutoff further out. */
+	if (turn_on) {
+		uloop_timeout_set(&jxi->keepalive,
+				  JXI_KEEPALIVE_TIMEOUT_S * 1000);
+		ustream_printf(out, "Starting heater. Timeout in %d sec. Re-send "
+			       "\"on\" command periodically to reset timeout.\n",
+			       JXI_KEEPALIVE_TIMEOUT_S);
+	} else if (!(ctl.flags & JXI_CTL_HEATER_ON)) {
+		uloop_timeout_cancel(&jxi->keepalive);
+	}
+
+	return jxi_heater_set_control(&jxi->dev, &ctl);
+}
+
+static int jxi_control(struct device *dev, struct ustream *out, int argc,
+		       char **argv)
+{
+	struct jxi_heater *jxi = to_jxi(dev);
+
+	if (!strcmp(argv[0], "setpoint"))
+		return jxi_control_setpoint(jxi, argc, argv);
+	if (!strcmp(argv[0], "heater"))
+		return jxi_control_heater(jxi, out, argc, argv);
+
+	return -EOPNOTSUPP;
+}
+
+/* Logs the flags in 'mask' that differ between 'old' and 'new'. */
+static void jxi_log_flag(uint8_t old, uint8_t new, uint8_t mask,
+			 const char *set, const char *cleared)
+{
+	if (!((old ^ new) & mask))
+		return;
+
+	ULOG_INFO("%s\n", new & mask ? set : cleared);
+}
+
+/*
+ * Readings rarely change from one poll to the next, so only changes are
+ * logged. The current state is always available through "status".
+ */
 static int jxi_handle_control_response(struct device *dev,
 				       const uint8_t *msg, size_t len)
 {
-	uint8_t status, huh, errors;
-
-	if (len < 5)
-		return -ENODATA;
+	struct jxi_heater *jxi = container_of(dev, struct jxi_heater, dev);
+	struct jxi_state *state = &jxi->state;
+	uint8_t status, huh, errors, old_status, old_errors;
+	unsigned long missed;
 
 	status = msg[2];
 	huh = msg[3];
 	errors = msg[4];
 
-	ULOG_INFO("sflags=%x, unknown=%x, eflags=%x\n", status, huh, errors);
+	/* Before the first reply, assume there was nothing to report. */
+	old_status = state->status_us ? state->status : 0;
+	old_errors = state->status_us ? state->errors : 0;
+
+	if (!state->status_us || status != state->status ||
+	    huh != state->unknown || errors != state->errors) {
+		ULOG_INFO("sflags=%x, unknown=%x, eflags=%x\n", status, huh,
+			  errors);
+		dev_state_changed(dev);
+	}
+
+	jxi_log_flag(old_status, status, JXI_STATUS_HEATING,
+		     "Heater is on or in the process of igniting",
+		     "Heater is off");
+	jxi_log_flag(old_status, status, JXI_STATUS_REMOTE_DISABLED,
+		     "Remote RS-485 is disabled at the panel",
+		     "Remote RS-485 is enabled at the panel");
 
-	if (status & 0x08)
-		ULOG_INFO("Heater is on or in the process of igniting");
-	if (status & 0x10)
-		ULOG_INFO("Remote RS-485 is disabled at the panel");
-	if (errors & 0x08)
-		ULOG_ERR("heater no burno\n");
+	/* An error persists over many polls. Remind, but don't flood. */
+	if (errors & JXI_ERROR_NO_IGNITION) {
+		if (ratelimit_pass(&jxi->no_ignition_log, dev->last_reply_us,
+				   &missed))
+			ULOG_ERR("heater no burno (%lu more since last "
+				 "report)\n", missed);
+	} else if (old_errors & JXI_ERROR_NO_IGNITION) {
+		ULOG_INFO("Heater ignition error cleared\n");
+		jxi->no_ignition_log = (struct ratelimit){ };
+	}
+
+	state->status = status;
+	state->unknown = huh;
+	state->errors = errors;
+	state->status_us = dev->last_reply_us;
+
+	if (jxi->in_flight) {
+		if (!jxi->have_acked ||
+		    memcmp(jxi->acked, jxi->sent, sizeof(jxi->acked)))
+			dev_state_changed(dev);
+		memcpy(jxi->acked, jxi->sent, sizeof(jxi->acked));
+		jxi->have_acked = true;
+		jxi->in_flight = false;
+	}
 
 	return 0;
 }
@@ -37,52 +354,157 @@ static int jxi_handle_control_response(struct device *dev,
 static int jxi_handle_measurements(struct device *dev,
 				   const uint8_t *msg, size_t len)
 {
+	struct jxi_state *state = jxi_state(dev);
 	uint16_t gv_on_time, cycles;
 	int temperature;
-
-	if (len < 9)
-		return -ENODATA;
+	int32_t values[HISTORY_MAX_VALUES];
 
 	gv_on_time = read16_le(msg + 2);
 	cycles = read16_le(msg + 4);
 	temperature = (int)msg[8] - 20;
 
-	ULOG_INFO("%d cycles, %d hours, temperature = %d\n", cycles, gv_on_time,
-		  temperature);
+	if (!state->measured_us || cycles != state->cycles ||
+	    gv_on_time != state->gv_on_hours ||
+	    temperature != state->temperature) {
+		ULOG_INFO("%d cycles, %d hours, temperature = %d\n", cycles,
+			  gv_on_time, temperature);
+		dev_state_changed(dev);
+	}
+
+	state->gv_on_hours = gv_on_time;
+	state->cycles = cycles;
+	state->temperature = temperature;
+	state->measured_us = dev->last_reply_us;
+
+	/* In the order of jxi_history_fields */
+	values[0] = temperature;
+	values[1] = cycles;
+	values[2] = gv_on_time;
+	history_add(&dev->history, time(NULL), values);
 
 	return 0;
 }
 
-static int jxi_handle_reply(struct device *dev, const uint8_t *reply,
-			    size_t len)
+/*
+ * Each round reads back the measurements, preceded by the control command
+ * while the heater has not acknowledged the desired state, or when it is due
+ * to be repeated. The reply to the command carries the status flags, so one
+ * round gives a complete view.
+ */
+static int jxi_get_next_request(struct device *dev, unsigned int seq,
+				uint8_t *msg, size_t len)
 {
-	uint8_t cmd = reply[1];
-	int ret;
+	struct jxi_heater *jxi = to_jxi(dev);
+	uint64_t now = monotonic_us();
 
-	switch (cmd) {
-		case JXI_COMMAND_REPLY:
-			ret = jxi_handle_control_response(dev, reply, len);
-			break;
-		case JXI_GET_MEASUREMENTS:
-			ret = jxi_handle_measurements(dev, reply, len);
-			break;
-		default:
-			ret = -EBADRQC;
-			break;
-	}
+	/* Sending the command changes what is due, so look only once. */
+	if (seq == 0)
+		jxi->round_command = jxi_control_pending(jxi) ||
+				     jxi_refresh_due(jxi, now);
 
-	return ret;
-}
+	if (seq > jxi->round_command || len < 2 + JXI_COMMAND_ARGS)
+		return 0;
 
-static int jxi_get_next_request(struct device *dev, uint8_t* msg, size_t len)
-{
 	msg[0] = 0x68;
+
+	if (jxi->round_command && seq == 0) {
+		msg[1] = JXI_COMMAND;
+		memcpy(msg + 2, jxi->desired, JXI_COMMAND_ARGS);
+		memcpy(jxi->sent, jxi->desired, sizeof(jxi->sent));
+		jxi->changed = false;
+		jxi->in_flight = true;
+		jxi->command_us = now;
+		return 2 + JXI_COMMAND_ARGS;
+	}
+
 	msg[1] = JXI_GET_MEASUREMENTS;
 
 	return 2;
 }
 
-const struct device_ops jxi_heater_ops = {
-	.handle_reply = jxi_handle_reply,
+static int jxi_get_schedule(struct device *dev, unsigned int *interval_ms)
+{
+	struct jxi_heater *jxi = to_jxi(dev);
+
+	*interval_ms = 500;
+
+	/*
+	 * Send fresh changes and due repeats right away. Retries wait for the
+	 * next poll.
+	 */
+	if (jxi->changed || jxi_refresh_due(jxi, monotonic_us()))
+		return AQUA_PRIO_URGENT;
+
+	return AQUA_PRIO_ROUTINE;
+}
+
+static void jxi_init(struct device *dev)
+{
+	to_jxi(dev)->keepalive.cb = jxi_keepalive_expired;
+}
+
+static void jxi_print_status(struct device *dev, struct ustream *out,
+			     const char *prefix, uint64_t now_us)
+{
+	struct jxi_heater *jxi = to_jxi(dev);
+	const struct jxi_state *state = &jxi->state;
+
+	if (jxi->have_desired)
+		ustream_printf(out, "%s control_flags=0x%02x pool_setpoint=%d "
+			       "spa_setpoint=%d acked=%d keepalive_s=%lld\n",
+			       prefix, jxi->desired[0],
+			       jxi_decode_temperature(jxi->desired[1]),
+			       jxi_decode_temperature(jxi->desired[2]),
+			       !jxi_control_pending(jxi),
+			       jxi->keepalive.pending ? (long long)
+			       uloop_timeout_remaining64(&jxi->keepalive) / 1000
+						      : 0);
+
+	if (state->measured_us)
+		ustream_printf(out, "%s temperature=%d cycles=%u gv_on_hours=%u "
+			       "age_ms=%llu\n", prefix, state->temperature,
+			       state->cycles, state->gv_on_hours,
+			       (unsigned long long)
+			       (now_us - state->measured_us) / 1000);
+
+	if (state->status_us)
+		ustream_printf(out, "%s status_flags=0x%02x unknown=0x%02x "
+			       "error_flags=0x%02x heating=%d remote_disabled=%d "
+			       "no_ignition=%d age_ms=%llu\n", prefix, state->status,
+			       state->unknown, state->errors,
+			       !!(state->status & JXI_STATUS_HEATING),
+			       !!(state->status & JXI_STATUS_REMOTE_DISABLED),
+			       !!(state->errors & JXI_ERROR_NO_IGNITION),
+			       (unsigned long long)
+			       (now_us - state->status_us) / 1000);
+}
+
+static const struct device_cmd jxi_cmds[] = {
+	[JXI_COMMAND_REPLY] = { jxi_handle_control_response, 5 },
+	[JXI_GET_MEASUREMENTS] = { jxi_handle_measurements, 9 },
+};
+
+static const char *const jxi_history_fields[] = {
+	"temperature", "cycles", "gv_on_hours",
+};
+
+static const struct device_ops jxi_heater_ops = {
+	.name = "jxi",
+	.size = sizeof(struct jxi_heater),
+	.cmds = jxi_cmds,
+	.num_cmds = ARRAY_SIZE(jxi_cmds),
+	.history_fields = jxi_history_fields,
+	.num_history_fields = ARRAY_SIZE(jxi_history_fields),
+	.init = jxi_init,
 	.get_next_request = jxi_get_next_request,
+	.get_schedule = jxi_get_schedule,
+	.print_status = jxi_print_status,
+	.control = jxi_control,
+};
+
+/* Only 0x68 has been seen in the wild. */
+const struct device_driver jxi_heater_driver = {
+	.ops = &jxi_heater_ops,
+	.first_addr = 0x68,
+	.last_addr = 0x68,
 };
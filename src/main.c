@@ -10,13 +10,17 @@
 
 #include <errno.h>
 #include <getopt.h>
+#include <limits.h>
 #include <linux/serial.h>
 #include <termios.h>
 #include <fcntl.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <unistd.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <time.h>
 
 #include <libubox/ustream.h>
 #include <libubox/ulog.h>
@@ -29,128 +33,384 @@ enum aqua_commands {
 
 struct rs485_frame {
 	struct list_head list;
-	uint8_t buf[32];
+	struct device *dev;
+	uint64_t queued_us;
+	uint64_t sent_us;
+	int priority;
+	uint8_t buf[AQUALINK_MAX_FRAME_LEN];
 	size_t len;
 };
 
+/*
+ * Frames are carved out of a fixed array allocated once at startup, so that a
+ * daemon running for months never touches the allocator on the bus path.
+ */
+struct rs485_frame_pool {
+	struct rs485_frame *frames;
+	struct list_head free_frames;
+	size_t size;
+	size_t in_use;
+	size_t high_water;
+};
+
+/*
+ * Replays a capture over a socketpair standing in for the tty. Received bytes
+ * go through rs485_notify_read(), and the recorded requests are re-issued so
+ * that replies are matched to the request they answered.
+ */
+struct aqua_replay {
+	struct aqua_ctx *ctx;
+	struct capture cap;
+	struct capture_record rec;
+	struct uloop_timeout next;
+	struct uloop_fd line;
+	uint64_t start_us;
+	unsigned long records;
+	bool have_rec;
+	bool fast;
+	bool wait_rx;
+};
+
+/* One RS-485 bus, with its own queue and devices. Buses run independently. */
 struct aqua_ctx {
+	struct list_head list;
+	unsigned int index;
+	const char *tty;
 	struct ustream_fd stream;
-	struct uloop_timeout probe_again;
 	struct uloop_timeout device_work;
 	struct uloop_timeout interframe_gap;
 	struct uloop_timeout rs485_timeout;
 	struct list_head pending_frames;
-	struct device slaves[10];
+	struct rs485_frame_pool pool;
+	struct aqualink_parser parser;
+	/* When the bytes now being parsed were read from the tty */
+	uint64_t rx_us;
+	unsigned long unsolicited;
+	struct ratelimit unsolicited_log;
+	struct ratelimit decode_log;
+	struct bus_usage usage;
+	uint64_t start_us;
+	struct capture capture;
+	struct uloop_timeout capture_flush;
+	struct aqua_replay *replay;
+	/* Listen only. Someone else is the bus master. */
+	bool monitor;
+	/* While monitoring, who the last request on the bus went to */
+	uint8_t monitor_dest;
+	unsigned int probe_max_ms;
+	unsigned int baud;
+	/* Devices in the order they were added, and indexed by bus address */
+	struct list_head slaves;
+	struct device *slave_by_addr[256];
 };
 
+/* 8N1 framing: each byte on the wire is 10 bit times long. */
+#define RS485_BITS_PER_BYTE	10
+/* Frame of a message, unescaped: header, message, checksum, footer */
+#define AQUA_FRAME_LEN(msg_len)	((msg_len) + 5)
+/* Shortest valid message: dest, cmd */
+#define AQUA_MIN_MSG_LEN	2
+/* Probe replies carry two bytes, which are always zero. */
+#define AQUA_PROBE_REPLY_LEN	4
+/* Allowance for the slave to turn the bus around and start replying */
+#define AQUA_TURNAROUND_US	5000
+/* Probes of absent devices back off exponentially, up to a configurable cap */
+#define AQUA_PROBE_INTERVAL_MS	2000
+#define AQUA_PROBE_MAX_MS	(5 * 60 * 1000)
+
+#define AQUA_MAX_BUSES		8
+
+/* A week of history per device, one sample a minute */
+#define AQUA_HISTORY_INTERVAL_S	60
+#define AQUA_HISTORY_CAPACITY	(7 * 24 * 60)
+
+/* Capture records are buffered, and written out this often */
+#define AQUA_CAPTURE_FLUSH_MS	1000
+
 static int rs485_send_next_frame(struct aqua_ctx *ctx);
+static void bus_schedule(struct aqua_ctx *ctx);
+
+static LIST_HEAD(aqua_buses);
+/* A bus went away, which is fatal, but the history is saved first. */
+static bool bus_lost;
+
+/* Bumped on every change of cached device state, for subscribers */
+static uint64_t state_generation;
+static bool state_changed;
+
+uint64_t monotonic_us(void)
+{
+	struct timespec ts;
 
-static int compare_dev_addr(const void *a, const void *b)
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void dev_state_changed(struct device *dev)
 {
-	const struct device *first = a;
-	const struct device *second = b;
+	dev->state_gen = ++state_generation;
+	state_changed = true;
+}
 
-	if (second->addr == 0x00)
-		return -1;
+/* Subscribers hear of all changes since the last call in one go. */
+static void publish_state_changes(void)
+{
+	if (!state_changed)
+		return;
 
-	return first->addr - second->addr;
+	state_changed = false;
+	control_publish(state_generation);
 }
 
-static struct device *lookup_slave(struct aqua_ctx *ctx, uint8_t dev_addr)
+static const struct {
+	unsigned int baud;
+	speed_t speed;
+} rs485_baud_rates[] = {
+	{ 1200, B1200 },
+	{ 2400, B2400 },
+	{ 4800, B4800 },
+	{ 9600, B9600 },
+	{ 19200, B19200 },
+	{ 38400, B38400 },
+	{ 57600, B57600 },
+	{ 115200, B115200 },
+	{ 230400, B230400 },
+};
+
+static int rs485_baud_to_speed(unsigned int baud, speed_t *speed)
 {
-	const struct device key = {
-		.addr = dev_addr,
-	};
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(rs485_baud_rates); i++) {
+		if (rs485_baud_rates[i].baud == baud) {
+			*speed = rs485_baud_rates[i].speed;
+			return 0;
+		}
+	}
 
-	return bsearch(&key, ctx->slaves, ARRAY_SIZE(ctx->slaves),
-			 sizeof(ctx->slaves[0]), compare_dev_addr);
+	return -EINVAL;
+}
+
+static uint32_t rs485_xmit_time_us(const struct aqua_ctx *ctx, size_t len)
+{
+	return len * RS485_BITS_PER_BYTE * 1000000ull / ctx->baud;
 }
 
+/* Modbus-style silent interval of 3.5 characters, rounded up. */
+static int rs485_interframe_gap_ms(const struct aqua_ctx *ctx)
+{
+	uint32_t gap_us = rs485_xmit_time_us(ctx, 7) / 2;
+
+	return (gap_us + 999) / 1000;
+}
+
+/* The longest reply 'frame' can get, as a message */
+static size_t rs485_max_reply_len(const struct rs485_frame *frame)
+{
+	if (!frame->dev)
+		return AQUA_MIN_MSG_LEN;
+	if (frame->buf[3] == AQUA_PROBE_REQUEST)
+		return AQUA_PROBE_REPLY_LEN;
+
+	return frame->dev->max_reply_len;
+}
+
+static int rs485_response_timeout_ms(const struct aqua_ctx *ctx,
+				     const struct rs485_frame *frame)
+{
+	uint32_t floor_us, timeout_us;
+
+	/* The request has to go out, and the whole reply come in. */
+	floor_us = rs485_xmit_time_us(ctx, frame->len) +
+		   rs485_xmit_time_us(ctx, AQUA_FRAME_LEN(
+					      rs485_max_reply_len(frame))) +
+		   AQUA_TURNAROUND_US;
+
+	timeout_us = (dev_rtt_timeout_us(frame->dev, floor_us) + 999) / 1000;
+	return timeout_us < AQUA_MAX_TIMEOUT_MS ? timeout_us : AQUA_MAX_TIMEOUT_MS;
+}
+
+static struct device *lookup_slave(struct aqua_ctx *ctx, uint8_t dev_addr)
+{
+	return ctx->slave_by_addr[dev_addr];
+}
+
+/* Devices are allocated once, and never move, as they embed live timers. */
 static int add_slave(struct aqua_ctx *ctx, uint8_t addr,
 		     const struct device_ops *ops)
 {
-	struct device *dev = lookup_slave(ctx, addr);
-	int i, last;
+	struct device *dev;
+	size_t i;
+
+	/* Address 0x00 belongs to the bus master, which is us. */
+	if (addr == 0)
+		return -EINVAL;
 
-	if (dev)
+	if (lookup_slave(ctx, addr))
 		return -EEXIST;
 
-	for (i = 0; i < ARRAY_SIZE(ctx->slaves); i++) {
-		if (ctx->slaves[i].addr == 0)
-			break;
+	dev = calloc(1, ops->size > sizeof(*dev) ? ops->size : sizeof(*dev));
+	if (!dev)
+		return -ENOMEM;
 
-		if (ctx->slaves[i].addr > addr)
-			break;
+	dev->addr = addr;
+	dev->ops = ops;
+	dev->max_reply_len = AQUA_MIN_MSG_LEN;
+	for (i = 0; i < ops->num_cmds; i++) {
+		if (ops->cmds[i].min_len > dev->max_reply_len)
+			dev->max_reply_len = ops->cmds[i].min_len;
 	}
+	if (ops->init)
+		ops->init(dev);
 
-	for (last = 0; last < ARRAY_SIZE(ctx->slaves); last++) {
-		if (ctx->slaves[last].addr == 0)
-			break;
-	}
+	list_add_tail(&dev->list, &ctx->slaves);
+	ctx->slave_by_addr[addr] = dev;
+
+	return 0;
+}
 
-	if (i >= ARRAY_SIZE(ctx->slaves) || last >= ARRAY_SIZE(ctx->slaves))
+static int rs485_pool_init(struct rs485_frame_pool *pool, size_t size)
+{
+	size_t i;
+
+	pool->frames = calloc(size, sizeof(*pool->frames));
+	if (!pool->frames)
 		return -ENOMEM;
 
-	if (last > i)
-		memmove(ctx->slaves + i + 1, ctx->slaves + i,
-			(last - i) * sizeof(ctx->slaves[0]));
+	INIT_LIST_HEAD(&pool->free_frames);
+	for (i = 0; i < size; i++)
+		list_add_tail(&pool->frames[i].list, &pool->free_frames);
 
-	dev = ctx->slaves + i;
-	dev->addr = addr;
-	dev->ops = ops;
+	pool->size = size;
+	pool->in_use = 0;
+	pool->high_water = 0;
 
 	return 0;
 }
 
-static void *memfind(const uint8_t *buf, size_t len, const uint8_t needle[2])
+static struct rs485_frame *rs485_frame_get(struct rs485_frame_pool *pool)
 {
-	const uint8_t *next;
-	uint8_t *start;
+	struct rs485_frame *frame;
 
-	do {
-		start = memchr(buf, needle[0], len - 1);
-		if (start && start[1] == needle[1])
-			break;
+	if (list_empty(&pool->free_frames))
+		return NULL;
 
-		next = start + 1;
-		len -= (ptrdiff_t)(next - buf);
-		buf = next;
-	} while(start);
+	frame = list_first_entry(&pool->free_frames, struct rs485_frame, list);
+	list_del(&frame->list);
 
-	return start;
+	pool->in_use++;
+	frame->len = 0;
+	return frame;
+}
+
+static void rs485_frame_put(struct rs485_frame_pool *pool,
+			    struct rs485_frame *frame)
+{
+	list_add(&frame->list, &pool->free_frames);
+	pool->in_use--;
+}
+
+static uint8_t rs485_frame_cmd(const struct rs485_frame *frame)
+{
+	/* An address of 0x10 is escaped, which pushes the command back. */
+	return frame->buf[frame->buf[2] == 0x10 ? 4 : 3];
+}
+
+/* Charge bus time to the bus, and to the device and command of 'frame'. */
+static void rs485_account(struct aqua_ctx *ctx,
+			  const struct rs485_frame *frame,
+			  const struct bus_usage *delta)
+{
+	struct bus_usage *usage;
+
+	usage_add(&ctx->usage, delta);
+
+	if (frame && frame->dev) {
+		usage = usage_for_cmd(&frame->dev->stats,
+				      rs485_frame_cmd(frame));
+		usage_add(usage, delta);
+	}
+}
+
+/* Retire the request at the head of the queue, answered or not. */
+static void rs485_frame_done(struct aqua_ctx *ctx, struct rs485_frame *frame)
+{
+	list_del(&frame->list);
+	if (frame->dev)
+		frame->dev->queued--;
+
+	rs485_frame_put(&ctx->pool, frame);
+}
+
+/*
+ * Nothing is on the wire. Send what is already queued, or else ask the
+ * scheduler for the next request, so the bus stays busy while there is work.
+ */
+static void rs485_bus_idle(struct aqua_ctx *ctx)
+{
+	if (rs485_send_next_frame(ctx) == -ENODATA)
+		bus_schedule(ctx);
 }
 
 static void rs485_no_response(struct uloop_timeout *t)
 {
 	struct aqua_ctx *ctx = container_of(t, struct aqua_ctx, rs485_timeout);
+	struct bus_usage delta = { };
 	struct rs485_frame *request;
+	uint64_t waited_us, tx_us;
 
 	request = list_first_entry(&ctx->pending_frames, struct rs485_frame,
 				   list);
 
+	waited_us = monotonic_us() - request->sent_us;
+	tx_us = rs485_xmit_time_us(ctx, request->len);
+	delta.timeout_us = waited_us > tx_us ? waited_us - tx_us : 0;
+	rs485_account(ctx, request, &delta);
+
+	if (request->dev) {
+		request->dev->stats.timeouts++;
+		dev_rtt_backoff(request->dev);
+	}
+
 	/* Move on, as we no longer expect a response to this request. */
-	list_del(&request->list);
-	free(request);
-	rs485_send_next_frame(ctx);
+	rs485_frame_done(ctx, request);
+	rs485_bus_idle(ctx);
 }
 
-static void rs485_send_after_interframe_gap(struct uloop_timeout *t)
+static void rs485_interframe_gap_done(struct uloop_timeout *t)
 {
 	struct aqua_ctx *ctx = container_of(t, struct aqua_ctx, interframe_gap);
 
-	rs485_send_next_frame(ctx);
+	if (!ctx->rs485_timeout.pending)
+		rs485_bus_idle(ctx);
 }
 
 static int rs485_send_frame(struct aqua_ctx *ctx, struct rs485_frame *frame)
 {
-	if (ctx->interframe_gap.pending) {
-		ctx->interframe_gap.cb = rs485_send_after_interframe_gap;
+	struct bus_usage delta = { };
+
+	/* Sent from rs485_interframe_gap_done() once the gap is over. */
+	if (ctx->interframe_gap.pending)
 		return -EAGAIN;
-	}
 
 	/* The timeout must include the time to transmit the request frame. */
 	ctx->rs485_timeout.cb = rs485_no_response;
-	uloop_timeout_set(&ctx->rs485_timeout, 200);
+	uloop_timeout_set(&ctx->rs485_timeout,
+			  rs485_response_timeout_ms(ctx, frame));
+	frame->sent_us = monotonic_us();
+	if (frame->dev) {
+		frame->dev->stats.requests++;
+		hist_add(&frame->dev->stats.queue_wait,
+			 frame->sent_us - frame->queued_us);
+	}
+
+	delta.requests = 1;
+	delta.tx_bytes = frame->len;
+	delta.tx_us = rs485_xmit_time_us(ctx, frame->len);
+	rs485_account(ctx, frame, &delta);
+
+	capture_write(&ctx->capture, frame->sent_us, CAPTURE_TX, frame->buf,
+		      frame->len);
 
 	return ustream_write(&ctx->stream.stream, (void *)frame->buf,
 			     frame->len, false);
@@ -161,16 +421,75 @@ static int rs485_send_next_frame(struct aqua_ctx *ctx)
 	struct rs485_frame *frame;
 
 	if (list_empty(&ctx->pending_frames))
-		return -EAGAIN;
+		return -ENODATA;
 
 	frame = list_first_entry(&ctx->pending_frames, struct rs485_frame, list);
 	return rs485_send_frame(ctx, frame);
 }
 
+/*
+ * Frames are kept in priority order, FIFO within the same priority. A frame
+ * already on the wire stays at the head no matter what arrives after it.
+ */
+static void rs485_insert_frame(struct aqua_ctx *ctx, struct rs485_frame *frame)
+{
+	struct list_head *pos = ctx->pending_frames.next;
+	struct rs485_frame *queued;
+
+	if (ctx->rs485_timeout.pending)
+		pos = pos->next;
+
+	for (; pos != &ctx->pending_frames; pos = pos->next) {
+		queued = list_entry(pos, struct rs485_frame, list);
+		if (queued->priority < frame->priority)
+			break;
+	}
+
+	list_add_tail(&frame->list, pos);
+}
+
+/* A free frame slot, for the caller to build the frame in. */
+static struct rs485_frame *rs485_frame_new(struct aqua_ctx *ctx)
+{
+	struct rs485_frame *frame;
+
+	/* Backpressure: the caller is expected to retry on a later cycle. */
+	frame = rs485_frame_get(&ctx->pool);
+	if (!frame)
+		ULOG_WARN("Frame queue full (%zu frames)\n", ctx->pool.size);
+
+	return frame;
+}
+
+static void rs485_submit_frame(struct aqua_ctx *ctx, struct rs485_frame *frame,
+			       int priority)
+{
+	struct rs485_frame_pool *pool = &ctx->pool;
+
+	/* Counted here, so that slots given back unused do not count. */
+	if (pool->in_use > pool->high_water) {
+		pool->high_water = pool->in_use;
+		ULOG_INFO("Frame queue high-water mark: %zu/%zu\n",
+			  pool->high_water, pool->size);
+	}
+
+	frame->priority = priority;
+	frame->queued_us = monotonic_us();
+	frame->dev = lookup_slave(ctx, frame->buf[2]);
+	if (frame->dev)
+		frame->dev->queued++;
+
+	rs485_insert_frame(ctx, frame);
+
+	/* Nothing on the wire, so this frame may go out right away. */
+	if (!ctx->rs485_timeout.pending)
+		rs485_send_next_frame(ctx);
+}
+
+/* Queue a frame built elsewhere, such as one read back from a capture. */
 static int rs485_queue_frame(struct aqua_ctx *ctx, const uint8_t *buf,
-			     size_t len)
+			     size_t len, int priority)
 {
-	bool queue_is_empty = list_empty(&ctx->pending_frames);
 	struct rs485_frame *frame;
 
 	if (len > sizeof(frame->buf)) {
@@ -178,17 +497,13 @@ static int rs485_queue_frame(struct aqua_ctx *ctx, const uint8_t *buf,
 		return -E2BIG;
 	}
 
-	frame = malloc(sizeof(*frame));
+	frame = rs485_frame_new(ctx);
 	if (!frame)
-		return -ENOMEM;
+		return -ENOBUFS;
 
-	memset(frame, 0, sizeof(*frame));
 	memcpy(frame->buf, buf, len);
 	frame->len = len;
-
-	list_add_tail(&frame->list, &ctx->pending_frames);
-	if (queue_is_empty)
-		return rs485_send_frame(ctx, frame);
+	rs485_submit_frame(ctx, frame, priority);
 
 	return 0;
 }
@@ -199,21 +514,56 @@ static void dev_clear_okay(struct uloop_timeout *t)
 
 	ULOG_WARN("Communication lost with device addr=0x%x\n", dev->addr);
 	dev->connected = 0;
+	dev_state_changed(dev);
+	dev->next_poll_us = 0;
+	dev->probe_interval_ms = 0;
+}
+
+static void dev_connected(struct device *dev)
+{
+	if (!dev->connected) {
+		ULOG_INFO("Established connection to device at 0x%x\n",
+			  dev->addr);
+		dev->next_poll_us = 0;
+		dev_state_changed(dev);
+	}
+
+	dev->connected = 1;
+	dev->probe_interval_ms = 0;
+	dev->data_expired.cb = dev_clear_okay;
+}
+
+/* Lengths are checked here, so that handlers can trust them. */
+static int dev_dispatch_reply(struct device *dev, const uint8_t *reply,
+			      size_t len)
+{
+	const struct device_ops *ops = dev->ops;
+	const struct device_cmd *cmd;
+
+	if (reply[1] >= ops->num_cmds)
+		return -EBADRQC;
+
+	cmd = &ops->cmds[reply[1]];
+	if (!cmd->handle)
+		return -EBADRQC;
+
+	if (len < cmd->min_len)
+		return -ENODATA;
+
+	return cmd->handle(dev, reply, len);
 }
 
-static int aqualink_handle_msg(struct aqua_ctx *ctx,
-			       const struct rs485_frame *request,
+/* Hands a reply from the device at 'dev_addr' to its driver. */
+static int aqualink_handle_msg(struct aqua_ctx *ctx, uint8_t dev_addr,
 			       const uint8_t *reply, size_t len)
 {
 	struct device *slave;
-	uint8_t cmd, dev_addr;
+	uint8_t cmd;
 	int ret = 0;
 
 	if (len < 2)
 		return -ENODATA;
 
-	dev_addr = request->buf[2];
-
 	slave = lookup_slave(ctx, dev_addr);
 	if (!slave)
 		return -ENODEV;
@@ -221,14 +571,14 @@ static int aqualink_handle_msg(struct aqua_ctx *ctx,
 	cmd = reply[1];
 	switch (cmd) {
 	case AQUA_PROBE_RESPONSE:
-		if (!slave->connected)
-			ULOG_INFO("Established connection to device at 0x%x\n",
-				  dev_addr);
-		slave->connected = 1;
-		slave->data_expired.cb = dev_clear_okay;
+		dev_connected(slave);
 		break;
 	default:
-		ret = slave->ops->handle_reply(slave, reply, len);
+		slave->last_reply_us = ctx->rx_us;
+		ret = dev_dispatch_reply(slave, reply, len);
+		/* The real master may have probed before we were listening. */
+		if (!ret && ctx->monitor)
+			dev_connected(slave);
 		break;
 	}
 
@@ -237,68 +587,168 @@ static int aqualink_handle_msg(struct aqua_ctx *ctx,
 	return ret;
 }
 
-static int aqualink_handle_frame(struct aqua_ctx *ctx,
-				 const struct rs485_frame *request,
-				 uint8_t *frame, size_t len)
+static void rs485_handle_rx_msg(struct aqua_ctx *ctx, const uint8_t *msg,
+				int msg_len)
 {
-	uint8_t buf[32];
-	int msg_len;
+	struct rs485_frame *request;
+	struct device_stats *stats;
+	struct bus_usage delta = { };
+	uint64_t now = ctx->rx_us, busy_us, handler_us;
+	struct ratelimit *limit;
+	unsigned long missed;
+	int ret, gap_ms = rs485_interframe_gap_ms(ctx);
+
+	uloop_timeout_set(&ctx->interframe_gap, gap_ms);
+
+	delta.rx_bytes = ctx->parser.frame_len;
+	delta.rx_us = rs485_xmit_time_us(ctx, ctx->parser.frame_len);
+	delta.gap_us = gap_ms * 1000;
+
+	/* A reply is only expected while the response timeout is armed. */
+	if (!ctx->rs485_timeout.pending) {
+		ctx->unsolicited++;
+		rs485_account(ctx, NULL, &delta);
+		if (ratelimit_pass(&ctx->unsolicited_log, now, &missed))
+			ULOG_ERR("Discarding unsolicited reply! (%lu more since "
+				 "last report)\n", missed);
+		return;
+	}
+
+	request = list_first_entry(&ctx->pending_frames, struct rs485_frame,
+				   list);
+	stats = request->dev ? &request->dev->stats : NULL;
+
+	/* Whatever part of the round trip was not spent transmitting */
+	busy_us = rs485_xmit_time_us(ctx, request->len) + delta.rx_us;
+	if (now - request->sent_us > busy_us)
+		delta.wait_us = now - request->sent_us - busy_us;
+	rs485_account(ctx, request, &delta);
 
-	msg_len = aqualink_frame_to_msg(buf, frame, len);
 	if (msg_len < 0) {
-		ULOG_ERR("Error decoding frame: %d\n", msg_len);
-		return msg_len;
+		if (ratelimit_pass(&ctx->decode_log, now, &missed))
+			ULOG_ERR("Error decoding frame: %d (%lu more since last "
+				 "report)\n", msg_len, missed);
+		if (stats && msg_len == -EPROTO)
+			stats->bad_checksums++;
+		ret = msg_len;
+	} else {
+		if (stats) {
+			stats->replies++;
+			hist_add(&stats->round_trip, now - request->sent_us);
+			dev_update_rtt(request->dev, now - request->sent_us);
+		}
+
+		handler_us = monotonic_us();
+		ret = aqualink_handle_msg(ctx, request->buf[2], msg, msg_len);
+		if (stats)
+			hist_add(&stats->handler, monotonic_us() - handler_us);
 	}
 
-	return aqualink_handle_msg(ctx, request, buf, msg_len);
+	/*
+	 * A device stuck in a bad state would otherwise flood the log. Frames
+	 * that did not decode were reported above, against their own limit.
+	 */
+	limit = request->dev ? &request->dev->unhandled_log : &ctx->decode_log;
+	if (ret && msg_len >= 0 && ratelimit_pass(limit, now, &missed))
+		ULOG_WARN("Unhandled frame (ret=%d, %lu more since last "
+			  "report)\n", ret, missed);
+
+	/* The next frame goes out when the interframe gap is over. */
+	rs485_frame_done(ctx, request);
+	uloop_timeout_cancel(&ctx->rs485_timeout);
 }
 
+/*
+ * Monitor records are one line per frame, made to be cheap to produce and to
+ * parse: seconds since start, "req", "rep" or "err", the address of the
+ * device, the command and the remaining payload in hex. The address of a
+ * reply is that of the last request, as replies go to the master at 0x00.
+ */
+static void monitor_print(struct aqua_ctx *ctx, const uint8_t *msg, int len)
+{
+	static const char hex[] = "0123456789abcdef";
+	char data[2 * AQUALINK_MAX_MSG_LEN + 1], *p = data;
+	uint64_t t = ctx->rx_us - ctx->start_us;
+	bool reply;
+	int i;
+
+	if (len < 2) {
+		printf("%llu.%06llu err %d\n", (unsigned long long)t / 1000000,
+		       (unsigned long long)t % 1000000, len);
+		return;
+	}
 
-static void rs485_notify_read(struct ustream *s, int bytes)
+	for (i = 2; i < len; i++) {
+		*p++ = hex[msg[i] >> 4];
+		*p++ = hex[msg[i] & 0xf];
+	}
+	*p = '\0';
+
+	reply = msg[0] == 0x00;
+	printf("%llu.%06llu %s %02x %02x%s%s\n", (unsigned long long)t / 1000000,
+	       (unsigned long long)t % 1000000, reply ? "rep" : "req",
+	       reply ? ctx->monitor_dest : msg[0], msg[1], len > 2 ? " " : "",
+	       data);
+}
+
+/* The state cache stays current, from whatever the real master asks for. */
+static void monitor_handle_msg(struct aqua_ctx *ctx, const uint8_t *msg,
+			       int len)
 {
-	struct ustream_fd *ufd = container_of(s, struct ustream_fd, stream);
-	struct aqua_ctx *ctx = container_of(ufd, struct aqua_ctx, stream);
-	const uint8_t header[] = { 0x10, 0x02 };
-	const uint8_t footer[] = { 0x10, 0x03 };
-	struct rs485_frame *request;
-	uint8_t *buf, *start, *end;
-	int ret, len, frame_len;
+	monitor_print(ctx, msg, len);
 
-	buf = (uint8_t *)ustream_get_read_buf(s, &len);
-	start = memfind(buf, len, header);
-	if (!start)
+	if (len < 2)
 		return;
 
-	len -= (start - buf);
-	end = memfind(buf, len, footer);
-	if (!end) {
-		/* The bytes before the header are junk. */
-		ustream_consume(s, start - buf);
+	if (msg[0] != 0x00) {
+		ctx->monitor_dest = msg[0];
 		return;
 	}
 
-	if (list_empty(&ctx->pending_frames)) {
-		ULOG_ERR("Discarding unsolicited reply!\n");
-		return;
-	}
+	aqualink_handle_msg(ctx, ctx->monitor_dest, msg, len);
+	ctx->monitor_dest = 0;
 
-	request = list_first_entry(&ctx->pending_frames, struct rs485_frame,
-				   list);
+	/* Another master's rounds are unknown, so publish every reply. */
+	publish_state_changes();
+}
 
-	frame_len = end - start + sizeof(footer);
-	ret = aqualink_handle_frame(ctx, request, start, frame_len);
-	if (ret) {
-		ULOG_WARN("Unhandled frame (ret=%d)", ret);
-	}
+static void rs485_parser_msg(struct aqualink_parser *p, const uint8_t *msg,
+			     int len)
+{
+	struct aqua_ctx *ctx = container_of(p, struct aqua_ctx, parser);
 
-	list_del(&request->list);
+	if (ctx->monitor)
+		monitor_handle_msg(ctx, msg, len);
+	else
+		rs485_handle_rx_msg(ctx, msg, len);
+}
 
-	uloop_timeout_cancel(&ctx->rs485_timeout);
-	/* 3.5 characters at 9600 baud is about 3.6 milliseconds. Round up. */
-	uloop_timeout_set(&ctx->interframe_gap, 4);
-	ustream_consume(s, end - buf + sizeof(footer));
-	rs485_send_next_frame(ctx);
-	free(request);
+static void rs485_notify_read(struct ustream *s, int bytes)
+{
+	struct ustream_fd *ufd = container_of(s, struct ustream_fd, stream);
+	struct aqua_ctx *ctx = container_of(ufd, struct aqua_ctx, stream);
+	uint8_t *buf;
+	int len;
+
+	/*
+	 * ustream_fd calls this right after its read(), so this is as close to
+	 * the arrival of the bytes as userspace gets. Everything parsed out of
+	 * them is stamped with it, rather than with when it was handled.
+	 */
+	ctx->rx_us = monotonic_us();
+
+	/* The parser keeps its state, so every byte is only looked at once. */
+	while ((buf = (uint8_t *)ustream_get_read_buf(s, &len))) {
+		capture_write(&ctx->capture, ctx->rx_us, CAPTURE_RX, buf, len);
+		aqualink_parser_feed(&ctx->parser, buf, len);
+		ustream_consume(s, len);
+	}
+
+	/* During replay, the next record waits until this one is handled. */
+	if (ctx->replay && ctx->replay->wait_rx) {
+		ctx->replay->wait_rx = false;
+		uloop_timeout_set(&ctx->replay->next, 0);
+	}
 }
 
 static void rs485_notify_state(struct ustream *s)
@@ -307,20 +757,59 @@ static void rs485_notify_state(struct ustream *s)
 		return;
 
 	ULOG_ERR("tty EOF. shutting down\n");
-	exit(-1);
+	bus_lost = true;
+	uloop_end();
 }
 
-static int rs485_stream_open(char *path, struct ustream_fd *s)
+static void rs485_stream_init(struct ustream_fd *s, int fd)
+{
+	s->stream.string_data = false;
+	s->stream.notify_read = rs485_notify_read;
+	s->stream.notify_state = rs485_notify_state;
+
+	ustream_fd_init(s, fd);
+}
+
+/*
+ * Without ASYNC_LOW_LATENCY, some UART drivers hold received bytes until the
+ * FIFO reaches its threshold or times out, which delays replies by several
+ * byte times. Not every driver knows the flag, so failing to set it is not
+ * fatal.
+ */
+static void rs485_set_low_latency(const char *path, int tty)
+{
+	struct serial_struct serial;
+
+	if (ioctl(tty, TIOCGSERIAL, &serial) < 0) {
+		ULOG_WARN("%s: cannot get serial info: %s\n", path,
+			  strerror(errno));
+		return;
+	}
+
+	serial.flags |= ASYNC_LOW_LATENCY;
+	if (ioctl(tty, TIOCSSERIAL, &serial) < 0)
+		ULOG_WARN("%s: cannot set low latency mode: %s\n", path,
+			  strerror(errno));
+}
+
+static int rs485_stream_open(const char *path, struct ustream_fd *s,
+			     speed_t speed, bool rs485, bool low_latency)
 {
 	int ret, tty;
 
+	/*
+	 * Wake up on every byte. A VMIN of a whole frame would save wakeups,
+	 * but the tty is polled, and the tail of a frame shorter than VMIN
+	 * would then sit unread until more bytes came in.
+	 */
 	struct termios tio = {
 		.c_oflag = 0,
 		.c_iflag = 0,
-		.c_cflag = B9600 | CS8 | CREAD | CLOCAL,
+		.c_cflag = CS8 | CREAD | CLOCAL,
 		.c_lflag = 0,
 		.c_cc = {
 			[VMIN] = 1,
+			[VTIME] = 0,
 		}
 	};
 
@@ -328,6 +817,9 @@ static int rs485_stream_open(char *path, struct ustream_fd *s)
 		.flags = SER_RS485_ENABLED | SER_RS485_RTS_ON_SEND,
 	};
 
+	cfsetispeed(&tio, speed);
+	cfsetospeed(&tio, speed);
+
 	tty = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
 	if (tty < 0) {
 		ULOG_ERR("%s: cannot open tty: %s\n", path, strerror(errno));
@@ -340,138 +832,1035 @@ static int rs485_stream_open(char *path, struct ustream_fd *s)
 		return -errno;
 	}
 
-	ret = ioctl (tty, TIOCSRS485, &rs485_cfg);
-	if (ret) {
-		ULOG_ERR("Can't set RS485 mode: %s\n", strerror(errno));
-		return -errno;
+	/*
+	 * USB adapters that switch direction by themselves, and the pty of
+	 * a simulated bus, have no RS-485 mode to enable. They have to be
+	 * asked for, as a missing mode on a real port means garbled frames.
+	 */
+	if (rs485) {
+		ret = ioctl (tty, TIOCSRS485, &rs485_cfg);
+		if (ret) {
+			ULOG_ERR("Can't set RS485 mode: %s\n", strerror(errno));
+			return -errno;
+		}
 	}
 
-	s->stream.string_data = false;
-	s->stream.notify_read = rs485_notify_read;
-	s->stream.notify_state = rs485_notify_state;
+	if (low_latency)
+		rs485_set_low_latency(path, tty);
 
-	ustream_fd_init(s, tty);
 	tcflush(tty, TCIFLUSH);
+	rs485_stream_init(s, tty);
 
 	return 0;
 }
 
-static void probe_bus(struct uloop_timeout *t)
+/* Wait before the next probe, doubling each time a probe goes unanswered. */
+static unsigned int dev_probe_interval_ms(const struct aqua_ctx *ctx,
+					  const struct device *dev)
 {
-	struct aqua_ctx *ctx = container_of(t, struct aqua_ctx, probe_again);
-	struct device *dev;
-	size_t i, frame_len;
-	uint8_t buf[32];
+	unsigned int interval_ms = 2 * dev->probe_interval_ms;
 
-	uint8_t probe[] = {0, AQUA_PROBE_REQUEST};
+	if (interval_ms < AQUA_PROBE_INTERVAL_MS)
+		interval_ms = AQUA_PROBE_INTERVAL_MS;
 
-	for (i = 0; i < ARRAY_SIZE(ctx->slaves); i++) {
-		dev = ctx->slaves + i;
-		if (dev->connected)
-			continue;
+	if (interval_ms > ctx->probe_max_ms)
+		interval_ms = ctx->probe_max_ms;
 
-		if (dev->addr == 0)
-			break;
+	return interval_ms;
+}
 
-		probe[0] = dev->addr;
-		frame_len = aqualink_msg_to_frame(buf, probe, sizeof(probe));
-		rs485_queue_frame(ctx, buf, frame_len);
-	}
+/* Messages are written straight into the frame, which is framed in place. */
+static uint8_t *rs485_frame_msg(struct rs485_frame *frame)
+{
+	return frame->buf + 2;
+}
 
-	uloop_timeout_set(t, 2 * 1000);
+static int bus_queue_probe(struct aqua_ctx *ctx, struct device *dev)
+{
+	struct rs485_frame *frame;
+	uint8_t *msg;
+
+	frame = rs485_frame_new(ctx);
+	if (!frame)
+		return -ENOBUFS;
+
+	msg = rs485_frame_msg(frame);
+	msg[0] = dev->addr;
+	msg[1] = AQUA_PROBE_REQUEST;
+	frame->len = aqualink_frame_in_place(frame->buf, 2);
+	rs485_submit_frame(ctx, frame, AQUA_PRIO_PROBE);
+
+	return 0;
 }
 
-static int handle_slave_request(struct aqua_ctx *ctx, struct device *dev)
+/* Queue the device's batch of requests. They keep their order in queue. */
+static int handle_slave_request(struct aqua_ctx *ctx, struct device *dev,
+				int priority)
 {
-	uint8_t msg_buf[32], buf[64];
-	int len, frame_len;
+	struct rs485_frame *frame;
+	unsigned int seq;
+	uint8_t *msg;
+	int len;
 
 	if (!dev->ops->get_next_request)
 		return -EOPNOTSUPP;
 
-	len = dev->ops->get_next_request(dev, msg_buf, sizeof(msg_buf));
-	if (len < 0)
-		return len;
+	for (seq = 0; seq < DEV_MAX_BATCH; seq++) {
+		/* Whatever made it into the queue still goes out. */
+		frame = rs485_frame_new(ctx);
+		if (!frame)
+			return seq ? 0 : -ENOBUFS;
+
+		msg = rs485_frame_msg(frame);
+		len = dev->ops->get_next_request(dev, seq, msg,
+						 AQUALINK_MAX_MSG_LEN);
+		if (len <= 0) {
+			rs485_frame_put(&ctx->pool, frame);
+			if (len < 0)
+				return seq ? 0 : len;
+			break;
+		}
 
-	msg_buf[0] = dev->addr;
-	frame_len = aqualink_msg_to_frame(buf, msg_buf, len);
-	return rs485_queue_frame(ctx, buf, frame_len);
+		msg[0] = dev->addr;
+		frame->len = aqualink_frame_in_place(frame->buf, len);
+		rs485_submit_frame(ctx, frame, priority);
+	}
+
+	/* An empty batch leaves the bus idle, with nothing to wake it up. */
+	return seq ? 0 : -ENODATA;
 }
 
-static void handle_connected_devices(struct uloop_timeout *t)
+/*
+ * Bus scheduler, run whenever the bus goes idle: pick the single most urgent
+ * request and put it on the wire. Urgent traffic goes first, then routine
+ * polls and probes once their interval has elapsed, earliest due first. When
+ * nothing is due, sleep until the earliest upcoming poll.
+ */
+static void bus_schedule(struct aqua_ctx *ctx)
+{
+	uint64_t due, best_due = 0, next_due = UINT64_MAX, now;
+	unsigned int interval_ms, best_interval = 0;
+	struct device *dev, *best = NULL;
+	int prio, best_prio = -1, ret;
+
+	if (ctx->rs485_timeout.pending || ctx->interframe_gap.pending ||
+	    !list_empty(&ctx->pending_frames))
+		return;
+
+	/* The round is over, so whatever it changed can be published. */
+	publish_state_changes();
+
+	/*
+	 * During replay, all bus traffic comes from the capture. A monitor
+	 * never transmits at all.
+	 */
+	if (ctx->replay || ctx->monitor)
+		return;
+
+	uloop_timeout_cancel(&ctx->device_work);
+	now = monotonic_us();
+
+	list_for_each_entry(dev, &ctx->slaves, list) {
+		if (!dev->connected) {
+			prio = AQUA_PRIO_PROBE;
+			interval_ms = dev_probe_interval_ms(ctx, dev);
+			due = dev->next_poll_us;
+		} else if (dev->ops->get_schedule) {
+			interval_ms = 0;
+			prio = dev->ops->get_schedule(dev, &interval_ms);
+			if (prio < AQUA_PRIO_URGENT && !interval_ms)
+				continue;
+
+			due = prio >= AQUA_PRIO_URGENT ? now : dev->next_poll_us;
+		} else {
+			continue;
+		}
+
+		if (due > now) {
+			if (due < next_due)
+				next_due = due;
+			continue;
+		}
+
+		if (prio > best_prio || (prio == best_prio && due < best_due)) {
+			best = dev;
+			best_prio = prio;
+			best_due = due;
+			best_interval = interval_ms;
+		}
+	}
+
+	if (!best) {
+		if (next_due != UINT64_MAX)
+			uloop_timeout_set(&ctx->device_work,
+					  (next_due - now + 999) / 1000);
+		return;
+	}
+
+	best->next_poll_us = now + best_interval * 1000ull;
+
+	if (best->connected) {
+		ret = handle_slave_request(ctx, best, best_prio);
+	} else {
+		/* Reset by the probe response, should the device answer. */
+		best->probe_interval_ms = best_interval;
+		ret = bus_queue_probe(ctx, best);
+	}
+
+	if (ret < 0) {
+		if (ret != -ENODATA)
+			ULOG_ERR("Slave addr=0x%x next request error %d\n",
+				 best->addr, ret);
+		/* Nothing went out, so the bus won't go idle again by itself. */
+		uloop_timeout_set(&ctx->device_work, 100);
+	}
+}
+
+static void bus_schedule_cb(struct uloop_timeout *t)
 {
 	struct aqua_ctx *ctx = container_of(t, struct aqua_ctx, device_work);
-	struct device *dev;
-	int i, ret;
 
-	if (!list_empty(&ctx->pending_frames)) {
-		ULOG_WARN("Bus contention. Delaying device work\n");
-		uloop_timeout_set(t, 100);
+	bus_schedule(ctx);
+}
+
+/* A recorded request: whatever was on the wire before it is over. */
+static void replay_request(struct aqua_ctx *ctx, const uint8_t *buf,
+			   size_t len)
+{
+	if (ctx->rs485_timeout.pending) {
+		uloop_timeout_cancel(&ctx->rs485_timeout);
+		rs485_no_response(&ctx->rs485_timeout);
+	}
+
+	/* The recorded timing already includes the interframe gap. */
+	uloop_timeout_cancel(&ctx->interframe_gap);
+	rs485_queue_frame(ctx, buf, len, AQUA_PRIO_URGENT);
+}
+
+static void capture_flush_cb(struct uloop_timeout *t)
+{
+	struct aqua_ctx *ctx = container_of(t, struct aqua_ctx, capture_flush);
+
+	capture_flush(&ctx->capture);
+	uloop_timeout_set(t, AQUA_CAPTURE_FLUSH_MS);
+}
+
+static void replay_finish(struct aqua_ctx *ctx)
+{
+	struct aqua_replay *replay = ctx->replay;
+	const struct aqualink_parser *p = &ctx->parser;
+
+	ULOG_INFO("Replayed %lu records in %.3f s: %lu frames, %lu errors, "
+		  "%lu resyncs, %lu junk bytes\n", replay->records,
+		  (monotonic_us() - replay->start_us) / 1e6, p->frames,
+		  p->errors, p->resyncs, p->junk_bytes);
+
+	capture_close(&replay->cap);
+	uloop_end();
+}
+
+static void replay_next(struct uloop_timeout *t)
+{
+	struct aqua_replay *replay = container_of(t, struct aqua_replay, next);
+	struct capture_record *rec = &replay->rec;
+	struct aqua_ctx *ctx = replay->ctx;
+	uint64_t elapsed;
+	int ret;
+
+	while (true) {
+		if (!replay->have_rec) {
+			ret = capture_read(&replay->cap, rec);
+			if (ret <= 0) {
+				if (ret < 0)
+					ULOG_ERR("Truncated capture file\n");
+				replay_finish(ctx);
+				return;
+			}
+			replay->have_rec = true;
+		}
+
+		elapsed = monotonic_us() - replay->start_us;
+		if (!replay->fast && rec->time_us > elapsed) {
+			uloop_timeout_set(t, (rec->time_us - elapsed) / 1000);
+			return;
+		}
+
+		replay->have_rec = false;
+		replay->records++;
+
+		if (rec->dir == CAPTURE_TX) {
+			replay_request(ctx, rec->data, rec->len);
+			continue;
+		}
+
+		if (write(replay->line.fd, rec->data, rec->len) != rec->len) {
+			ULOG_ERR("Replay write failed: %s\n", strerror(errno));
+			replay_finish(ctx);
+			return;
+		}
+
+		/* Carry on once the daemon has read it. */
+		replay->wait_rx = true;
 		return;
 	}
+}
+
+/* Our requests arrive at the far end of the virtual line. */
+static void replay_drain_line(struct uloop_fd *fd, unsigned int events)
+{
+	uint8_t buf[256];
+
+	while (read(fd->fd, buf, sizeof(buf)) > 0)
+		;
+}
+
+static int replay_open(struct aqua_ctx *ctx, const char *path, bool fast)
+{
+	struct aqua_replay *replay;
+	int ret, sv[2];
+
+	replay = calloc(1, sizeof(*replay));
+	if (!replay)
+		return -ENOMEM;
+
+	ret = capture_open(&replay->cap, path);
+	if (ret < 0) {
+		ULOG_ERR("%s: cannot open capture: %s\n", path, strerror(-ret));
+		free(replay);
+		return ret;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv)) {
+		ret = -errno;
+		capture_close(&replay->cap);
+		free(replay);
+		return ret;
+	}
+
+	replay->ctx = ctx;
+	replay->fast = fast;
+	replay->next.cb = replay_next;
+	replay->line.fd = sv[1];
+	replay->line.cb = replay_drain_line;
+	uloop_fd_add(&replay->line, ULOOP_READ);
+
+	ctx->replay = replay;
+	rs485_stream_init(&ctx->stream, sv[0]);
+
+	replay->start_us = monotonic_us();
+	uloop_timeout_set(&replay->next, 0);
 
-	for (i = 0; i < ARRAY_SIZE(ctx->slaves); i++) {
-		dev = ctx->slaves + i;
+	return 0;
+}
+
+/*
+ * Devices are named "addr" on all buses, or "bus:addr" on just one. Returns
+ * the bus index, or -1 for all buses, and sets the address.
+ */
+static int control_parse_dev(const char *arg, unsigned long *addr)
+{
+	unsigned long bus = -1;
+	const char *sep;
+	char *end;
+
+	sep = strchr(arg, ':');
+	if (sep) {
+		bus = strtoul(arg, &end, 0);
+		if (end != sep || bus >= AQUA_MAX_BUSES)
+			return -ENODEV;
+		arg = sep + 1;
+	}
+
+	*addr = strtoul(arg, &end, 0);
+	if (*end || !*addr || *addr > 0xff)
+		return -ENODEV;
+
+	return bus == -1UL ? -1 : (int)bus;
+}
+
+/* Finds the buses and devices a control command applies to. */
+static bool control_match(const struct aqua_ctx *ctx, const struct device *dev,
+			  int bus, unsigned long addr)
+{
+	if (bus >= 0 && ctx->index != bus)
+		return false;
+
+	return !addr || dev->addr == addr;
+}
+
+/* Checks that a device named on the command line exists somewhere. */
+static int control_find_dev(int argc, char **argv, int *bus,
+			    unsigned long *addr)
+{
+	struct aqua_ctx *ctx;
+	struct device *dev;
+	int ret;
+
+	*bus = -1;
+	*addr = 0;
+	if (argc < 2)
+		return 0;
+
+	ret = control_parse_dev(argv[1], addr);
+	if (ret == -ENODEV)
+		return ret;
+	*bus = ret;
+
+	list_for_each_entry(ctx, &aqua_buses, list) {
+		list_for_each_entry(dev, &ctx->slaves, list) {
+			if (control_match(ctx, dev, *bus, *addr))
+				return 0;
+		}
+	}
+
+	return -ENODEV;
+}
+
+/* "probe [[bus:]addr]": probe absent devices now, forgetting any backoff. */
+static int control_probe(struct control_cmd *cmd, struct ustream *out,
+			 int argc, char **argv)
+{
+	struct aqua_ctx *ctx;
+	struct device *dev;
+	unsigned long addr;
+	int bus, ret, probed = 0;
+
+	ret = control_find_dev(argc, argv, &bus, &addr);
+	if (ret)
+		return ret;
+
+	list_for_each_entry(ctx, &aqua_buses, list) {
+		list_for_each_entry(dev, &ctx->slaves, list) {
+			if (!control_match(ctx, dev, bus, addr))
+				continue;
+
+			if (dev->connected)
+				continue;
+
+			dev->next_poll_us = 0;
+			dev->probe_interval_ms = 0;
+			ustream_printf(out, "probing %u:0x%02x\n", ctx->index,
+				       dev->addr);
+			probed++;
+		}
+
+		/* Runs right away if the bus is idle, else when it goes idle. */
+		bus_schedule(ctx);
+	}
+
+	return addr && !probed ? -EALREADY : 0;
+}
+
+static void control_bus_stats(struct ustream *out, struct aqua_ctx *ctx)
+{
+	const struct aqualink_parser *p = &ctx->parser;
+	uint64_t uptime_us = monotonic_us() - ctx->start_us;
+	const struct device_stats *stats;
+	struct device *dev;
+	char prefix[40];
+	unsigned int i;
+
+	ustream_printf(out, "bus%u tty=%s uptime_s=%llu busy_pct=%.2f\n",
+		       ctx->index, ctx->tty,
+		       (unsigned long long)uptime_us / 1000000,
+		       uptime_us ? 100.0 * usage_busy_us(&ctx->usage) / uptime_us
+				 : 0);
+	snprintf(prefix, sizeof(prefix), "bus%u usage", ctx->index);
+	usage_print(out, prefix, &ctx->usage);
+	ustream_printf(out, "bus%u frames=%lu errors=%lu resyncs=%lu junk=%lu "
+		       "unsolicited=%lu queue=%zu/%zu high_water=%zu\n",
+		       ctx->index, p->frames, p->errors, p->resyncs,
+		       p->junk_bytes, ctx->unsolicited, ctx->pool.in_use,
+		       ctx->pool.size, ctx->pool.high_water);
+
+	list_for_each_entry(dev, &ctx->slaves, list) {
+		stats = &dev->stats;
+		snprintf(prefix, sizeof(prefix), "bus%u dev 0x%02x", ctx->index,
+			 dev->addr);
+
+		ustream_printf(out, "%s connected=%d srtt_us=%u rttvar_us=%u "
+			       "requests=%lu replies=%lu timeouts=%lu "
+			       "bad_checksums=%lu\n", prefix, !!dev->connected,
+			       dev->srtt_us, dev->rttvar_us, stats->requests,
+			       stats->replies, stats->timeouts,
+			       stats->bad_checksums);
+		hist_print(out, prefix, "queue_wait", &stats->queue_wait);
+		hist_print(out, prefix, "round_trip", &stats->round_trip);
+		hist_print(out, prefix, "handler", &stats->handler);
+
+		for (i = 0; i < stats->num_usage; i++) {
+			snprintf(prefix, sizeof(prefix),
+				 "bus%u dev 0x%02x cmd 0x%02x", ctx->index,
+				 dev->addr, stats->usage[i].cmd);
+			usage_print(out, prefix, &stats->usage[i].usage);
+		}
+	}
+}
+
+/* "stats": bus health counters and latency histograms */
+static int control_stats(struct control_cmd *cmd, struct ustream *out,
+			 int argc, char **argv)
+{
+	struct aqua_ctx *ctx;
+
+	list_for_each_entry(ctx, &aqua_buses, list)
+		control_bus_stats(out, ctx);
+
+	return 0;
+}
+
+static void control_print_dev(struct ustream *out, struct aqua_ctx *ctx,
+			      struct device *dev, uint64_t now)
+{
+	char prefix[24];
+
+	snprintf(prefix, sizeof(prefix), "bus%u dev 0x%02x", ctx->index,
+		 dev->addr);
+	ustream_printf(out, "%s driver=%s connected=%d", prefix, dev->ops->name,
+		       !!dev->connected);
+	if (dev->last_reply_us)
+		ustream_printf(out, " age_ms=%llu", (unsigned long long)
+			       (now - dev->last_reply_us) / 1000);
+	ustream_printf(out, "\n");
+
+	if (dev->ops->print_status)
+		dev->ops->print_status(dev, out, prefix, now);
+}
+
+/* "status [[bus:]addr]": last known device state, without bus traffic */
+static int control_status(struct control_cmd *cmd, struct ustream *out,
+			  int argc, char **argv)
+{
+	uint64_t now = monotonic_us();
+	struct aqua_ctx *ctx;
+	struct device *dev;
+	unsigned long addr;
+	int bus, ret;
+
+	ret = control_find_dev(argc, argv, &bus, &addr);
+	if (ret)
+		return ret;
+
+	list_for_each_entry(ctx, &aqua_buses, list) {
+		list_for_each_entry(dev, &ctx->slaves, list) {
+			if (control_match(ctx, dev, bus, addr))
+				control_print_dev(out, ctx, dev, now);
+		}
+	}
+
+	return 0;
+}
+
+/* Events for subscribers, in the same format as "status" */
+static void control_print_changes(struct ustream *out, uint64_t since)
+{
+	uint64_t now = monotonic_us();
+	struct aqua_ctx *ctx;
+	struct device *dev;
 
-		if (dev->addr == 0)
+	list_for_each_entry(ctx, &aqua_buses, list) {
+		list_for_each_entry(dev, &ctx->slaves, list) {
+			if (!since || dev->state_gen > since)
+				control_print_dev(out, ctx, dev, now);
+		}
+	}
+}
+
+/*
+ * "<command> [[bus:]addr] args...": commands handled by device drivers, for
+ * all devices whose driver knows the command, or just the one named.
+ */
+static int control_driver_cmd(struct control_cmd *cmd, struct ustream *out,
+			      int argc, char **argv)
+{
+	struct aqua_ctx *ctx;
+	struct device *dev;
+	unsigned long addr = 0;
+	int bus = -1, ret, handled = 0, err = 0;
+
+	if (argc > 1 && control_parse_dev(argv[1], &addr) != -ENODEV) {
+		ret = control_find_dev(argc, argv, &bus, &addr);
+		if (ret)
+			return ret;
+
+		/* The driver sees the command name, then its arguments. */
+		argv[1] = argv[0];
+		argv++;
+		argc--;
+	}
+
+	list_for_each_entry(ctx, &aqua_buses, list) {
+		list_for_each_entry(dev, &ctx->slaves, list) {
+			if (!control_match(ctx, dev, bus, addr) ||
+			    !dev->ops->control)
+				continue;
+
+			ret = dev->ops->control(dev, out, argc, argv);
+			if (ret == -EOPNOTSUPP)
+				continue;
+
+			handled++;
+			if (ret < 0)
+				err = ret;
+			else if (ret > 0)
+				bus_schedule(ctx);
+		}
+	}
+
+	if (!handled)
+		return -ENODEV;
+
+	return err;
+}
+
+struct control_history {
+	struct ustream *out;
+	const char *prefix;
+	const struct device_ops *ops;
+};
+
+static void control_print_sample(const struct history_sample *s, void *priv)
+{
+	struct control_history *ch = priv;
+	unsigned int i;
+
+	ustream_printf(ch->out, "%s time=%u", ch->prefix, s->time_s);
+	for (i = 0; i < ch->ops->num_history_fields; i++)
+		ustream_printf(ch->out, " %s=%d", ch->ops->history_fields[i],
+			       s->values[i]);
+	ustream_printf(ch->out, "\n");
+}
+
+/* Times are Unix times, or seconds before now when negative. */
+static int control_parse_time(const char *arg, uint32_t now_s, uint32_t *t)
+{
+	char *end;
+	long val;
+
+	val = strtol(arg, &end, 0);
+	if (*end)
+		return -EINVAL;
+
+	*t = val < 0 ? now_s + val : (uint32_t)val;
+	return 0;
+}
+
+/* "history [bus:]addr [from_s [to_s]]": samples from the history file */
+static int control_history(struct control_cmd *cmd, struct ustream *out,
+			   int argc, char **argv)
+{
+	struct control_history ch = { .out = out };
+	uint32_t now_s = time(NULL), from_s = 0, to_s = now_s;
+	struct aqua_ctx *ctx;
+	struct device *dev;
+	unsigned long addr;
+	char prefix[24];
+	int bus, ret;
+
+	if (argc < 2 || argc > 4)
+		return -EINVAL;
+
+	ret = control_find_dev(argc, argv, &bus, &addr);
+	if (ret)
+		return ret;
+
+	if ((argc > 2 && control_parse_time(argv[2], now_s, &from_s)) ||
+	    (argc > 3 && control_parse_time(argv[3], now_s, &to_s)))
+		return -EINVAL;
+
+	list_for_each_entry(ctx, &aqua_buses, list) {
+		list_for_each_entry(dev, &ctx->slaves, list) {
+			if (!control_match(ctx, dev, bus, addr) ||
+			    !dev->history.map)
+				continue;
+
+			snprintf(prefix, sizeof(prefix), "bus%u dev 0x%02x",
+				 ctx->index, dev->addr);
+			ch.prefix = prefix;
+			ch.ops = dev->ops;
+			history_query(&dev->history, from_s, to_s,
+				      control_print_sample, &ch);
+		}
+	}
+
+	return 0;
+}
+
+static struct control_cmd control_cmds[] = {
+	{
+		.name = "probe",
+		.help = "[[bus:]addr] - probe absent devices now",
+		.handler = control_probe,
+	},
+	{
+		.name = "stats",
+		.help = "- bus health counters and latency histograms",
+		.handler = control_stats,
+	},
+	{
+		.name = "status",
+		.help = "[[bus:]addr] - last known state of devices",
+		.handler = control_status,
+	},
+	{
+		.name = "history",
+		.help = "[bus:]addr [from_s [to_s]] - recorded measurements",
+		.handler = control_history,
+	},
+	{
+		.name = "setpoint",
+		.help = "[[bus:]addr] pool|spa <temp>C|F - set heater setpoint",
+		.handler = control_driver_cmd,
+	},
+	{
+		.name = "heater",
+		.help = "[[bus:]addr] [pool|spa|on|off]... - heater mode",
+		.handler = control_driver_cmd,
+	},
+};
+
+/*
+ * Seconds, no shorter than the first probe interval: a cap of 0 would have
+ * absent devices probed back to back, taking up the whole bus.
+ */
+static int parse_probe_max(const char *arg, unsigned int *max_ms)
+{
+	unsigned long val;
+	char *end;
+
+	errno = 0;
+	val = strtoul(arg, &end, 0);
+	if (errno || end == arg || *end || val < AQUA_PROBE_INTERVAL_MS / 1000 ||
+	    val > UINT_MAX / 1000)
+		return -EINVAL;
+
+	*max_ms = val * 1000;
+	return 0;
+}
+
+/* Address ranges given with --addresses, in place of those of the driver */
+struct addr_override {
+	const char *driver;
+	unsigned int first_addr;
+	unsigned int last_addr;
+};
+
+static struct addr_override addr_overrides[8];
+static unsigned int num_addr_overrides;
+
+/* "<driver>=<first>[-<last>]", for a driver built into the daemon */
+static int parse_addr_override(char *arg)
+{
+	struct addr_override *o;
+	char *sep, *end;
+	size_t i;
+
+	if (num_addr_overrides == ARRAY_SIZE(addr_overrides))
+		return -ENOSPC;
+
+	sep = strchr(arg, '=');
+	if (!sep)
+		return -EINVAL;
+
+	o = &addr_overrides[num_addr_overrides];
+	o->first_addr = strtoul(sep + 1, &end, 0);
+	o->last_addr = o->first_addr;
+	if (*end == '-')
+		o->last_addr = strtoul(end + 1, &end, 0);
+
+	if (*end || !o->first_addr || o->first_addr > o->last_addr ||
+	    o->last_addr > 0xff)
+		return -EINVAL;
+
+	for (i = 0; i < aqua_num_drivers; i++) {
+		if (!strncmp(aqua_drivers[i]->ops->name, arg, sep - arg) &&
+		    !aqua_drivers[i]->ops->name[sep - arg])
 			break;
+	}
+	if (i == aqua_num_drivers)
+		return -ENOENT;
 
-		if (!dev->connected)
+	o->driver = aqua_drivers[i]->ops->name;
+	num_addr_overrides++;
+	return 0;
+}
+
+static void driver_addr_range(const struct device_driver *drv,
+			      unsigned int *first, unsigned int *last)
+{
+	unsigned int i;
+
+	*first = drv->first_addr;
+	*last = drv->last_addr;
+
+	for (i = 0; i < num_addr_overrides; i++) {
+		if (strcmp(addr_overrides[i].driver, drv->ops->name))
 			continue;
 
-		ret = handle_slave_request(ctx, dev);
-		if (ret < 0) {
-			ULOG_ERR("Slave addr=0x%x next request error %d\n",
-				 dev->addr, ret);
+		*first = addr_overrides[i].first_addr;
+		*last = addr_overrides[i].last_addr;
+	}
+}
+
+/* Sets up a bus, with the devices expected on it, before it is opened. */
+static struct aqua_ctx *bus_create(const char *tty, size_t queue_depth,
+				   unsigned int baud, unsigned int probe_max_ms)
+{
+	static unsigned int num_buses;
+	const struct device_driver *drv;
+	unsigned int addr, first, last;
+	struct aqua_ctx *ctx;
+	size_t i;
+	int ret;
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (!ctx)
+		return NULL;
+
+	ctx->index = num_buses++;
+	ctx->tty = tty;
+	ctx->baud = baud;
+	ctx->probe_max_ms = probe_max_ms;
+	ctx->device_work.cb = bus_schedule_cb;
+	ctx->interframe_gap.cb = rs485_interframe_gap_done;
+	INIT_LIST_HEAD(&ctx->pending_frames);
+	INIT_LIST_HEAD(&ctx->slaves);
+	ctx->start_us = monotonic_us();
+	aqualink_parser_init(&ctx->parser, rs485_parser_msg);
+
+	if (!queue_depth || rs485_pool_init(&ctx->pool, queue_depth)) {
+		ULOG_ERR("Cannot allocate frame queue of depth %zu\n",
+			 queue_depth);
+		goto err;
+	}
+
+	for (i = 0; i < aqua_num_drivers; i++) {
+		drv = aqua_drivers[i];
+		driver_addr_range(drv, &first, &last);
+		for (addr = first; addr <= last; addr++) {
+			ret = add_slave(ctx, addr, drv->ops);
+			if (ret) {
+				ULOG_ERR("%s: cannot add device 0x%02x: %d\n",
+					 drv->ops->name, addr, ret);
+				goto err;
+			}
+		}
+	}
+
+	list_add_tail(&ctx->list, &aqua_buses);
+	return ctx;
+
+err:
+	free(ctx->pool.frames);
+	free(ctx);
+	return NULL;
+}
+
+/* One ring file per device whose driver records history */
+static int bus_open_history(struct aqua_ctx *ctx, const char *dir)
+{
+	struct device *dev;
+	char path[256];
+	int ret;
+
+	list_for_each_entry(dev, &ctx->slaves, list) {
+		if (!dev->ops->num_history_fields)
 			continue;
+
+		snprintf(path, sizeof(path), "%s/bus%u-%02x.hist", dir,
+			 ctx->index, dev->addr);
+		ret = history_open(&dev->history, path, AQUA_HISTORY_CAPACITY,
+				   AQUA_HISTORY_INTERVAL_S);
+		if (ret < 0) {
+			ULOG_ERR("%s: cannot open history: %s\n", path,
+				 strerror(-ret));
+			return ret;
 		}
 	}
 
-	uloop_timeout_set(t, 500);
+	return 0;
 }
 
 int main(int argc, char *argv[])
 {
-	char *tty_dev = "/dev/ttyS0";
+	const char *ttys[AQUA_MAX_BUSES];
+	char *socket_path = NULL;
+	char *capture_path = NULL, *replay_path = NULL;
+	char *history_dir = NULL;
+	bool replay_fast = false, monitor = false, low_latency = false;
+	bool rs485 = true;
+	size_t queue_depth = 16;
+	unsigned int baud = 9600, probe_max_ms = AQUA_PROBE_MAX_MS;
+	unsigned int num_ttys = 0;
+	struct aqua_ctx *ctx;
+	struct device *dev;
+	speed_t speed;
+	size_t i;
 	int opt, ret;
 
 	const struct option options[] = {
 		{"tty", required_argument, 0, 't'},
+		{"queue-depth", required_argument, 0, 'q'},
+		{"baud", required_argument, 0, 'b'},
+		{"probe-backoff-max", required_argument, 0, 'p'},
+		{"socket", required_argument, 0, 's'},
+		{"capture", required_argument, 0, 'c'},
+		{"replay", required_argument, 0, 'r'},
+		{"replay-fast", no_argument, 0, 'f'},
+		{"monitor", no_argument, 0, 'm'},
+		{"low-latency", no_argument, 0, 'l'},
+		{"no-rs485", no_argument, 0, 'n'},
+		{"history-dir", required_argument, 0, 'H'},
+		{"addresses", required_argument, 0, 'a'},
 		{ }
 	};
 
-	struct aqua_ctx ctx = {
-		.probe_again.cb = probe_bus,
-		.device_work.cb = handle_connected_devices,
-	};
-
 	do {
 		opt = getopt_long(argc, argv, "", options, NULL);
 		switch (opt) {
 		case 't':
-			tty_dev = optarg;
+			/* Each --tty is a separate bus. */
+			if (num_ttys == ARRAY_SIZE(ttys)) {
+				ULOG_ERR("At most %zu buses are supported\n",
+					 ARRAY_SIZE(ttys));
+				return EXIT_FAILURE;
+			}
+			ttys[num_ttys++] = optarg;
+			break;
+		case 'q':
+			queue_depth = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			baud = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			if (parse_probe_max(optarg, &probe_max_ms)) {
+				ULOG_ERR("Bad --probe-backoff-max %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 's':
+			socket_path = optarg;
+			break;
+		case 'c':
+			capture_path = optarg;
+			break;
+		case 'r':
+			replay_path = optarg;
+			break;
+		case 'f':
+			replay_fast = true;
+			break;
+		case 'm':
+			monitor = true;
+			break;
+		case 'l':
+			low_latency = true;
+			break;
+		case 'n':
+			rs485 = false;
+			break;
+		case 'H':
+			history_dir = optarg;
+			break;
+		case 'a':
+			/* Devices set to other addresses, or a simulated bus */
+			if (parse_addr_override(optarg)) {
+				ULOG_ERR("Bad --addresses %s\n", optarg);
+				return EXIT_FAILURE;
+			}
 			break;
 		}
 	} while (opt > 0);
 
-	INIT_LIST_HEAD(&ctx.pending_frames);
+	if (rs485_baud_to_speed(baud, &speed)) {
+		ULOG_ERR("Unsupported baud rate %u\n", baud);
+		return EXIT_FAILURE;
+	}
 
-	ret = add_slave(&ctx, 0x68, &jxi_heater_ops);
-	if (ret) {
-		ULOG_ERR("Internal error: %d\n", ret);
+	/* The capture stands in for the tty, so there is nothing to open. */
+	if (replay_path && num_ttys) {
+		ULOG_ERR("--replay cannot be used with --tty\n");
+		return EXIT_FAILURE;
+	}
+
+	if (replay_path)
+		ttys[num_ttys++] = "replay";
+	else if (!num_ttys)
+		ttys[num_ttys++] = "/dev/ttyS0";
+
+	/* Capture files have no notion of which bus a record came from. */
+	if ((capture_path || replay_path) && num_ttys > 1) {
+		ULOG_ERR("--capture and --replay work on a single bus\n");
+		return EXIT_FAILURE;
+	}
+
+	/* Replayed requests are re-issued, which a monitor never does. */
+	if (monitor && replay_path) {
+		ULOG_ERR("--monitor cannot be used with --replay\n");
 		return EXIT_FAILURE;
 	}
 
+	for (i = 0; i < num_ttys; i++) {
+		ctx = bus_create(ttys[i], queue_depth, baud, probe_max_ms);
+		if (!ctx)
+			return EXIT_FAILURE;
+
+		ctx->monitor = monitor;
+	}
+
 	ulog_open(ULOG_STDIO | ULOG_SYSLOG, LOG_DAEMON, "aqua-control");
 	ulog_threshold(LOG_INFO);
 	ULOG_ERR("%s: Starting up\n", argv[0]);
 	uloop_init();
 
-	if (rs485_stream_open(tty_dev, &ctx.stream) < 0)
-		return -1;
+	list_for_each_entry(ctx, &aqua_buses, list) {
+		if (capture_path) {
+			ret = capture_create(&ctx->capture, capture_path,
+					     monotonic_us());
+			if (ret < 0) {
+				ULOG_ERR("%s: cannot create capture: %s\n",
+					 capture_path, strerror(-ret));
+				return -1;
+			}
+
+			ctx->capture_flush.cb = capture_flush_cb;
+			uloop_timeout_set(&ctx->capture_flush,
+					  AQUA_CAPTURE_FLUSH_MS);
+		}
+
+		if (replay_path)
+			ret = replay_open(ctx, replay_path, replay_fast);
+		else
+			ret = rs485_stream_open(ctx->tty, &ctx->stream, speed,
+						rs485, low_latency);
+		if (ret < 0)
+			return -1;
+
+		if (history_dir && bus_open_history(ctx, history_dir) < 0)
+			return -1;
+
+		uloop_timeout_set(&ctx->device_work, 1000);
+	}
+
+	if (socket_path) {
+		if (control_init(socket_path) < 0)
+			return -1;
+
+		for (i = 0; i < ARRAY_SIZE(control_cmds); i++)
+			control_register(&control_cmds[i]);
+		control_set_publisher(control_print_changes);
+	}
 
-	uloop_timeout_set(&ctx.probe_again, 1000);
-	uloop_timeout_set(&ctx.device_work, 1200);
 	uloop_run();
 	uloop_done();
+
+	/* Whatever is still batched would be lost otherwise. */
+	list_for_each_entry(ctx, &aqua_buses, list) {
+		capture_close(&ctx->capture);
+		list_for_each_entry(dev, &ctx->slaves, list)
+			history_close(&dev->history);
+	}
+
+	return bus_lost ? -1 : 0;
 }
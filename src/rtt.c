@@ -0,0 +1,63 @@
+/*
+ * Round-trip estimate of each device, from which response timeouts derive
+ *
+ * The estimator is the one TCP uses for its retransmit timeout, as in
+ * RFC 6298, with the bus in place of the network.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "aqualink-internal.h"
+
+/*
+ * Classic Jacobson/Karels estimator: track the smoothed round-trip time and
+ * its mean deviation.
+ */
+void dev_update_rtt(struct device *dev, uint32_t rtt_us)
+{
+	uint32_t delta;
+
+	if (!dev->srtt_us) {
+		dev->srtt_us = rtt_us;
+		dev->rttvar_us = rtt_us / 2;
+		return;
+	}
+
+	delta = rtt_us > dev->srtt_us ? rtt_us - dev->srtt_us
+				      : dev->srtt_us - rtt_us;
+	dev->rttvar_us = (3 * dev->rttvar_us + delta) / 4;
+	dev->srtt_us = (7 * dev->srtt_us + rtt_us) / 8;
+}
+
+/* A device we thought was alive did not answer. Be more patient next time. */
+void dev_rtt_backoff(struct device *dev)
+{
+	if (!dev->connected || !dev->srtt_us)
+		return;
+
+	dev->rttvar_us = 2 * dev->rttvar_us + 1000;
+	if (dev->rttvar_us > AQUA_MAX_TIMEOUT_MS * 1000)
+		dev->rttvar_us = AQUA_MAX_TIMEOUT_MS * 1000;
+}
+
+/*
+ * How long to wait for a reply which cannot possibly arrive in less than
+ * 'floor_us'. On a bus with steady timing the deviation shrinks to nothing,
+ * so, as RFC 6298 does with the clock granularity, it is given a lower bound
+ * to cover scheduling delays on both ends.
+ */
+uint32_t dev_rtt_timeout_us(const struct device *dev, uint32_t floor_us)
+{
+	uint32_t timeout_us, var_us;
+
+	if (dev && dev->srtt_us) {
+		var_us = 4 * dev->rttvar_us;
+		if (var_us < AQUA_RTT_MARGIN_US)
+			var_us = AQUA_RTT_MARGIN_US;
+		timeout_us = dev->srtt_us + var_us;
+	} else {
+		timeout_us = floor_us + AQUA_INITIAL_RTT_US;
+	}
+
+	return timeout_us > floor_us ? timeout_us : floor_us;
+}
@@ -0,0 +1,103 @@
+/*
+ * Latency histograms and bus usage accounting for bus health monitoring
+ *
+ * Buckets have fixed bounds, so that recording a sample is cheap enough for
+ * the reply path, and histograms from different devices can be compared.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "aqualink-internal.h"
+
+#include <libubox/ustream.h>
+#include <libubox/utils.h>
+
+/* Upper bounds of the buckets, in microseconds. The last one is open. */
+static const uint32_t hist_bounds_us[HIST_NUM_BUCKETS - 1] = {
+	100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000,
+};
+
+void hist_add(struct latency_hist *h, uint32_t us)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(hist_bounds_us); i++) {
+		if (us < hist_bounds_us[i])
+			break;
+	}
+
+	h->buckets[i]++;
+	h->count++;
+	h->sum_us += us;
+	if (us > h->max_us)
+		h->max_us = us;
+}
+
+void hist_print(struct ustream *out, const char *prefix, const char *name,
+		const struct latency_hist *h)
+{
+	size_t i;
+
+	ustream_printf(out, "%s %s count=%u avg_us=%llu max_us=%u", prefix,
+		       name, h->count,
+		       h->count ? (unsigned long long)h->sum_us / h->count : 0,
+		       h->max_us);
+
+	for (i = 0; i < ARRAY_SIZE(hist_bounds_us); i++)
+		ustream_printf(out, " <%u:%u", hist_bounds_us[i], h->buckets[i]);
+
+	ustream_printf(out, " >=%u:%u\n", hist_bounds_us[i - 1], h->buckets[i]);
+}
+
+/*
+ * Usage is broken down per command code. Devices speak only a handful of
+ * commands, so a short array beats a table. Should a device use more, the
+ * last slot is shared by all the remaining codes.
+ */
+struct bus_usage *usage_for_cmd(struct device_stats *stats, uint8_t cmd)
+{
+	struct cmd_usage *cu;
+	unsigned int i;
+
+	for (i = 0; i < stats->num_usage; i++) {
+		if (stats->usage[i].cmd == cmd)
+			return &stats->usage[i].usage;
+	}
+
+	if (stats->num_usage == ARRAY_SIZE(stats->usage))
+		return &stats->usage[ARRAY_SIZE(stats->usage) - 1].usage;
+
+	cu = &stats->usage[stats->num_usage++];
+	cu->cmd = cmd;
+	return &cu->usage;
+}
+
+void usage_add(struct bus_usage *dest, const struct bus_usage *delta)
+{
+	dest->requests += delta->requests;
+	dest->tx_bytes += delta->tx_bytes;
+	dest->rx_bytes += delta->rx_bytes;
+	dest->tx_us += delta->tx_us;
+	dest->rx_us += delta->rx_us;
+	dest->gap_us += delta->gap_us;
+	dest->wait_us += delta->wait_us;
+	dest->timeout_us += delta->timeout_us;
+}
+
+uint64_t usage_busy_us(const struct bus_usage *u)
+{
+	return u->tx_us + u->rx_us + u->gap_us + u->wait_us + u->timeout_us;
+}
+
+void usage_print(struct ustream *out, const char *prefix,
+		 const struct bus_usage *u)
+{
+	ustream_printf(out, "%s requests=%lu tx_bytes=%lu rx_bytes=%lu "
+		       "tx_us=%llu rx_us=%llu gap_us=%llu wait_us=%llu "
+		       "timeout_us=%llu\n", prefix, u->requests, u->tx_bytes,
+		       u->rx_bytes, (unsigned long long)u->tx_us,
+		       (unsigned long long)u->rx_us,
+		       (unsigned long long)u->gap_us,
+		       (unsigned long long)u->wait_us,
+		       (unsigned long long)u->timeout_us);
+}
@@ -0,0 +1,186 @@
+/*
+ * Aqualink control - Microbenchmarks for the packet framer
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "aqualink-internal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <libubox/utils.h>
+
+#define BENCH_NUM_MSGS		64
+#define BENCH_MSG_LEN		16
+
+struct bench_set {
+	const char *name;
+	uint8_t msgs[BENCH_NUM_MSGS][AQUALINK_MAX_MSG_LEN];
+	uint8_t frames[BENCH_NUM_MSGS][2 * AQUALINK_MAX_MSG_LEN + 7];
+	size_t msg_lens[BENCH_NUM_MSGS];
+	size_t frame_lens[BENCH_NUM_MSGS];
+	size_t num;
+};
+
+/* Messages seen on the wire between a master and a JXi heater */
+static const struct {
+	size_t len;
+	uint8_t msg[AQUALINK_MAX_MSG_LEN];
+} captured[] = {
+	{ 3, { 0x68, 0x00, 0x00 } },
+	{ 4, { 0x00, 0x01, 0x00, 0x00 } },
+	{ 3, { 0x68, 0x25, 0x00 } },
+	{ 9, { 0x00, 0x25, 0x12, 0x00, 0x3b, 0x01, 0x00, 0x00, 0x20 } },
+	{ 9, { 0x00, 0x25, 0x15, 0x00, 0x56, 0x01, 0xf5, 0x00, 0x23 } },
+	{ 6, { 0x68, 0x0c, 0x09, 0x50, 0x66, 0xff } },
+	{ 5, { 0x00, 0x0d, 0x08, 0x00, 0x00 } },
+	{ 4, { 0x68, 0x10, 0xbe, 0x10 } },
+};
+
+static volatile size_t bench_sink;
+
+static uint64_t bench_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void bench_set_add(struct bench_set *set, const uint8_t *msg, size_t len)
+{
+	size_t i = set->num++;
+
+	memcpy(set->msgs[i], msg, len);
+	set->msg_lens[i] = len;
+	set->frame_lens[i] = aqualink_msg_to_frame(set->frames[i], msg, len);
+}
+
+static void bench_fill(struct bench_set *set, const char *name, int kind)
+{
+	uint8_t msg[BENCH_MSG_LEN];
+	size_t i, j;
+
+	set->name = name;
+	set->num = 0;
+
+	for (i = 0; i < BENCH_NUM_MSGS; i++) {
+		if (kind == 3) {
+			j = i % ARRAY_SIZE(captured);
+			bench_set_add(set, captured[j].msg, captured[j].len);
+			continue;
+		}
+
+		for (j = 0; j < sizeof(msg); j++) {
+			switch (kind) {
+			case 0:
+				/* Never 0x10, so nothing needs escaping */
+				msg[j] = 0x20 + (i + j) % 0x60;
+				break;
+			case 1:
+				msg[j] = 0x10;
+				break;
+			default:
+				msg[j] = rand();
+				break;
+			}
+		}
+
+		bench_set_add(set, msg, sizeof(msg));
+	}
+}
+
+static size_t bench_one(const struct bench_set *set, int op)
+{
+	uint8_t out[2 * sizeof(set->frames[0])];
+	size_t i, in_bytes = 0, sum = 0;
+
+	for (i = 0; i < set->num; i++) {
+		switch (op) {
+		case 0:
+			sum += aqualink_msg_to_frame(out, set->msgs[i],
+						     set->msg_lens[i]);
+			in_bytes += set->msg_lens[i];
+			break;
+		case 1:
+			sum += aqualink_frame_to_msg(out, set->frames[i],
+						     set->frame_lens[i]);
+			in_bytes += set->frame_lens[i];
+			break;
+		case 2:
+			sum += aqualink_frame_to_msg_ref(out, set->frames[i],
+							 set->frame_lens[i]);
+			in_bytes += set->frame_lens[i];
+			break;
+		case 3:
+			sum += aqualink_pack(out, set->msgs[i],
+					     set->msg_lens[i]);
+			in_bytes += set->msg_lens[i];
+			break;
+		case 4:
+			/* Unpack the escaped body, without header and footer */
+			sum += aqualink_unpack(out, set->frames[i] + 2,
+					       set->frame_lens[i] - 4);
+			in_bytes += set->frame_lens[i] - 4;
+			break;
+		case 5:
+			/* Stands in for a driver writing its request in place */
+			memcpy(out + 2, set->msgs[i], set->msg_lens[i]);
+			sum += aqualink_frame_in_place(out, set->msg_lens[i]);
+			in_bytes += set->msg_lens[i];
+			break;
+		}
+	}
+
+	bench_sink += sum;
+	return in_bytes;
+}
+
+static void bench_run(const struct bench_set *set, unsigned long iterations)
+{
+	static const char *const ops[] = {
+		"msg_to_frame", "frame_to_msg", "frame_to_msg_ref", "pack",
+		"unpack", "frame_in_place",
+	};
+	uint64_t start, elapsed_ns;
+	size_t op, bytes;
+	unsigned long i;
+	double frames;
+
+	for (op = 0; op < ARRAY_SIZE(ops); op++) {
+		bytes = 0;
+		start = bench_now_ns();
+		for (i = 0; i < iterations; i++)
+			bytes += bench_one(set, op);
+		elapsed_ns = bench_now_ns() - start;
+
+		frames = (double)iterations * set->num;
+		printf("%-10s %-18s %10.1f ns/frame %10.2f MB/s\n", set->name,
+		       ops[op], elapsed_ns / frames,
+		       bytes * 1000.0 / (elapsed_ns ? elapsed_ns : 1));
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	static const char *const names[] = {
+		"no-escape", "all-0x10", "random", "captured",
+	};
+	unsigned long iterations = 20000;
+	static struct bench_set set;
+	size_t kind;
+
+	if (argc > 1)
+		iterations = strtoul(argv[1], NULL, 0);
+
+	srand(1);
+	for (kind = 0; kind < ARRAY_SIZE(names); kind++) {
+		bench_fill(&set, names[kind], kind);
+		bench_run(&set, iterations);
+	}
+
+	return 0;
+}
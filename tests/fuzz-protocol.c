@@ -0,0 +1,234 @@
+/*
+ * Aqualink control - Fuzz target for the framer and the read path
+ *
+ * Built against libFuzzer with -DFUZZ_LIBFUZZER. Otherwise a main() runs the
+ * target over each file given, or stdin, as AFL expects, or with "-r <count>"
+ * over random inputs. Any disagreement between the decoders calls abort().
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "aqualink-internal.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libubox/utils.h>
+
+#define FUZZ_MAX_INPUT		4096
+
+#define fuzz_check(cond) do {						\
+	if (!(cond)) {							\
+		fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+		abort();						\
+	}								\
+} while (0)
+
+/* Whatever the parser reported, folded so that two runs can be compared */
+struct fuzz_parser {
+	struct aqualink_parser parser;
+	unsigned long num_msgs;
+	uint32_t hash;
+};
+
+static uint32_t fuzz_hash(uint32_t hash, const uint8_t *buf, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		hash = (hash ^ buf[i]) * 16777619;
+
+	return hash;
+}
+
+static void fuzz_collect(struct aqualink_parser *p, const uint8_t *msg,
+			 int len)
+{
+	struct fuzz_parser *fp = container_of(p, struct fuzz_parser, parser);
+	uint8_t rec[sizeof(int)];
+
+	fuzz_check(len <= AQUALINK_MAX_MSG_LEN);
+	fuzz_check(p->frame_len >= 4);
+
+	memcpy(rec, &len, sizeof(rec));
+	fp->hash = fuzz_hash(fp->hash, rec, sizeof(rec));
+	if (len > 0)
+		fp->hash = fuzz_hash(fp->hash, msg, len);
+	fp->num_msgs++;
+}
+
+/* Byte at a time, the obviously correct way */
+static size_t fuzz_unpack_ref(uint8_t *dest, const uint8_t *buf, size_t len)
+{
+	size_t i, out = 0;
+
+	for (i = 0; i < len; i++) {
+		dest[out++] = buf[i];
+		if (buf[i] == 0x10 && i + 1 < len && buf[i + 1] == 0x00)
+			i++;
+	}
+
+	return out;
+}
+
+static void fuzz_unpack(const uint8_t *data, size_t size)
+{
+	static uint8_t ref[FUZZ_MAX_INPUT], out[FUZZ_MAX_INPUT];
+	size_t ref_len, len;
+
+	ref_len = fuzz_unpack_ref(ref, data, size);
+
+	len = aqualink_unpack(out, data, size);
+	fuzz_check(len == ref_len && !memcmp(out, ref, len));
+
+	/* In place, as the reference decoder uses it */
+	memcpy(out, data, size);
+	len = aqualink_unpack(out, out, size);
+	fuzz_check(len == ref_len && !memcmp(out, ref, len));
+}
+
+/* Both decoders must accept the same frames, and agree on their contents. */
+static void fuzz_frame_to_msg(const uint8_t *data, size_t size)
+{
+	static uint8_t msg[FUZZ_MAX_INPUT], ref[FUZZ_MAX_INPUT];
+	int len, ref_len;
+
+	len = aqualink_frame_to_msg(msg, data, size);
+	fuzz_check(len < 0 || (size_t)len <= size);
+
+	ref_len = aqualink_frame_to_msg_ref(ref, data, size);
+	if (len >= 0)
+		fuzz_check(len == ref_len && !memcmp(msg, ref, len));
+}
+
+/* Splitting the stream anywhere must not change what is parsed out of it. */
+static void fuzz_parser(const uint8_t *data, size_t size)
+{
+	struct fuzz_parser whole = { }, split = { };
+	size_t i, step;
+
+	aqualink_parser_init(&whole.parser, fuzz_collect);
+	aqualink_parser_feed(&whole.parser, data, size);
+
+	aqualink_parser_init(&split.parser, fuzz_collect);
+	step = size ? data[0] % 7 + 1 : 1;
+	for (i = 0; i < size; i += step)
+		aqualink_parser_feed(&split.parser, data + i,
+				     size - i < step ? size - i : step);
+
+	fuzz_check(whole.num_msgs == split.num_msgs);
+	fuzz_check(whole.hash == split.hash);
+	fuzz_check(whole.parser.frames == split.parser.frames);
+	fuzz_check(whole.parser.errors == split.parser.errors);
+	fuzz_check(whole.parser.junk_bytes == split.parser.junk_bytes);
+	fuzz_check(whole.parser.frames + whole.parser.errors <= whole.num_msgs);
+}
+
+/* Any message framed either way must come back out unchanged. */
+static void fuzz_round_trip(const uint8_t *data, size_t size)
+{
+	uint8_t frame[AQUALINK_MAX_FRAME_LEN], in_place[AQUALINK_MAX_FRAME_LEN];
+	uint8_t msg[AQUALINK_MAX_FRAME_LEN];
+	struct fuzz_parser fp = { };
+	size_t frame_len;
+	int len;
+
+	if (!size)
+		return;
+	if (size > AQUALINK_MAX_MSG_LEN)
+		size = AQUALINK_MAX_MSG_LEN;
+
+	frame_len = aqualink_msg_to_frame(frame, data, size);
+	fuzz_check(frame_len <= AQUALINK_FRAME_CAPACITY(size));
+
+	memcpy(in_place + 2, data, size);
+	fuzz_check(aqualink_frame_in_place(in_place, size) == frame_len);
+	fuzz_check(!memcmp(in_place, frame, frame_len));
+
+	len = aqualink_frame_to_msg(msg, frame, frame_len);
+	fuzz_check(len == (int)size && !memcmp(msg, data, size));
+
+	aqualink_parser_init(&fp.parser, fuzz_collect);
+	aqualink_parser_feed(&fp.parser, frame, frame_len);
+	fuzz_check(fp.parser.frames == 1 && fp.parser.frame_len == frame_len);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	if (size > FUZZ_MAX_INPUT)
+		return 0;
+
+	fuzz_unpack(data, size);
+	fuzz_frame_to_msg(data, size);
+	fuzz_parser(data, size);
+	fuzz_round_trip(data, size);
+
+	return 0;
+}
+
+#ifndef FUZZ_LIBFUZZER
+static void fuzz_file(FILE *f)
+{
+	static uint8_t buf[FUZZ_MAX_INPUT];
+	size_t len;
+
+	len = fread(buf, 1, sizeof(buf), f);
+	LLVMFuzzerTestOneInput(buf, len);
+}
+
+/*
+ * Random inputs lean on the bytes that mean something to the framer, or
+ * there would hardly ever be a frame among them.
+ */
+static void fuzz_random(unsigned long count)
+{
+	static const uint8_t interesting[] = { 0x10, 0x02, 0x03, 0x00 };
+	uint8_t buf[256];
+	unsigned long n;
+	size_t len, i;
+
+	srand(1);
+	for (n = 0; n < count; n++) {
+		len = rand() % sizeof(buf);
+		for (i = 0; i < len; i++) {
+			if (rand() & 1)
+				buf[i] = interesting[rand() % sizeof(interesting)];
+			else
+				buf[i] = rand();
+		}
+
+		LLVMFuzzerTestOneInput(buf, len);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	FILE *f;
+	int i;
+
+	if (argc == 3 && !strcmp(argv[1], "-r")) {
+		fuzz_random(strtoul(argv[2], NULL, 0));
+		return 0;
+	}
+
+	if (argc < 2) {
+		fuzz_file(stdin);
+		return 0;
+	}
+
+	for (i = 1; i < argc; i++) {
+		f = fopen(argv[i], "rb");
+		if (!f) {
+			perror(argv[i]);
+			return 1;
+		}
+
+		fuzz_file(f);
+		fclose(f);
+	}
+
+	return 0;
+}
+#endif
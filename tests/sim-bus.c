@@ -0,0 +1,573 @@
+/*
+ * Aqualink control - Simulated bus of JXi heaters, for load tests
+ *
+ * Creates a pty, and answers requests written to it as a number of JXi
+ * heaters at consecutive addresses would, following the protocol described
+ * in documentation/protocol_jandy_jxi.md. Run aquamasterd on the other end:
+ *
+ *	sim-bus --devices 8 --link /tmp/sim.tty --socket /tmp/aq.sock &
+ *	aquamasterd --tty /tmp/sim.tty --no-rs485 \
+ *		--addresses jxi=0x68-0x6f --socket /tmp/aq.sock
+ *
+ * A pty delivers bytes at once, so replies are held back for as long as the
+ * request and reply would take on the wire, plus the response delay. Replies
+ * can also be dropped, or have a bit flipped, at random.
+ *
+ * With --socket, setpoint changes are sent to the daemon's control socket,
+ * one device at a time, and the time until the command reaches the bus is
+ * recorded. At the end, the poll rates seen by each device, the command
+ * latency, and the daemon's own bus statistics are printed.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#define _GNU_SOURCE
+#include "aqualink-internal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <libubox/uloop.h>
+#include <libubox/utils.h>
+
+#define SIM_MAX_DEVICES		64
+#define SIM_MAX_SAMPLES		4096
+
+struct sim_dev {
+	uint8_t addr;
+	/* Arguments of the last control command */
+	uint8_t flags;
+	uint8_t pool_setpoint;
+	uint8_t spa_setpoint;
+	uint16_t gv_on_hours;
+	uint16_t cycles;
+	/* As sent, 20 above the reading */
+	uint8_t raw_temperature;
+
+	unsigned long probes;
+	unsigned long polls;
+	unsigned long commands;
+	unsigned long dropped;
+	unsigned long corrupted;
+	uint64_t first_poll_us;
+	uint64_t last_poll_us;
+
+	/* Setpoint asked of the daemon, not yet seen in a command, or -1 */
+	int want_pool;
+	uint64_t want_us;
+};
+
+struct sim_config {
+	unsigned int num_devs;
+	unsigned int first_addr;
+	unsigned int delay_ms;
+	unsigned int baud;
+	double dropout_pct;
+	double corrupt_pct;
+	unsigned int duration_s;
+	unsigned int command_interval_ms;
+	const char *socket_path;
+	const char *link_path;
+};
+
+static struct sim_config cfg = {
+	.num_devs = 1,
+	.first_addr = 0x68,
+	.delay_ms = 2,
+	.baud = 9600,
+	.duration_s = 30,
+	.command_interval_ms = 1000,
+};
+
+static struct sim_dev devs[SIM_MAX_DEVICES];
+static struct aqualink_parser parser;
+static struct uloop_fd pty;
+static struct uloop_fd control;
+static struct uloop_timeout reply_timer;
+static struct uloop_timeout command_timer;
+static struct uloop_timeout end_timer;
+static uint8_t reply[AQUALINK_MAX_FRAME_LEN];
+static size_t reply_len;
+static unsigned int next_command_dev;
+static unsigned long requests, bad_requests, collisions;
+static uint32_t latency_us[SIM_MAX_SAMPLES];
+static unsigned int num_latency;
+static uint64_t start_us;
+
+uint64_t monotonic_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static bool sim_chance(double pct)
+{
+	return pct > 0 && rand() < pct / 100 * RAND_MAX;
+}
+
+/* Like a real bus, at 10 bit times per byte */
+static unsigned int sim_xmit_ms(size_t bytes)
+{
+	return (bytes * 10 * 1000 + cfg.baud - 1) / cfg.baud;
+}
+
+static struct sim_dev *sim_lookup(uint8_t addr)
+{
+	if (addr < cfg.first_addr || addr >= cfg.first_addr + cfg.num_devs)
+		return NULL;
+
+	return &devs[addr - cfg.first_addr];
+}
+
+static void sim_send_reply(struct uloop_timeout *t)
+{
+	if (write(pty.fd, reply, reply_len) < 0)
+		perror("write");
+}
+
+/* Heats when told to, and in exactly one of pool or spa mode */
+static bool sim_heating(const struct sim_dev *dev)
+{
+	uint8_t mode = dev->flags & (JXI_CTL_POOL | JXI_CTL_SPA);
+
+	return (dev->flags & JXI_CTL_HEATER_ON) &&
+	       (mode == JXI_CTL_POOL || mode == JXI_CTL_SPA);
+}
+
+static void sim_command(struct sim_dev *dev, const uint8_t *msg, int len,
+			uint64_t now)
+{
+	bool was_heating = sim_heating(dev);
+
+	dev->commands++;
+	dev->flags = msg[2];
+	dev->pool_setpoint = msg[3];
+	dev->spa_setpoint = msg[4];
+	if (!was_heating && sim_heating(dev))
+		dev->cycles++;
+
+	if (dev->want_pool >= 0 && dev->pool_setpoint == dev->want_pool) {
+		if (num_latency < ARRAY_SIZE(latency_us))
+			latency_us[num_latency++] = now - dev->want_us;
+		dev->want_pool = -1;
+	}
+}
+
+static void sim_handle_request(struct aqualink_parser *p, const uint8_t *msg,
+			       int len)
+{
+	uint8_t out[AQUALINK_MAX_MSG_LEN];
+	uint64_t now = monotonic_us();
+	struct sim_dev *dev;
+	size_t out_len = 0, bit;
+
+	requests++;
+	if (len < 2) {
+		bad_requests++;
+		return;
+	}
+
+	dev = sim_lookup(msg[0]);
+	if (!dev)
+		return;
+
+	out[0] = 0x00;
+	switch (msg[1]) {
+	case 0x00:
+		dev->probes++;
+		out[1] = 0x01;
+		out[2] = out[3] = 0x00;
+		out_len = 4;
+		break;
+	case 0x0c:
+		if (len < 6) {
+			bad_requests++;
+			return;
+		}
+
+		sim_command(dev, msg, len, now);
+		out[1] = 0x0d;
+		out[2] = sim_heating(dev) ? 0x08 : 0x00;
+		out[3] = out[4] = 0x00;
+		out_len = 5;
+		break;
+	case 0x25:
+		if (!dev->polls++)
+			dev->first_poll_us = now;
+		dev->last_poll_us = now;
+		out[1] = 0x25;
+		out[2] = dev->gv_on_hours;
+		out[3] = dev->gv_on_hours >> 8;
+		out[4] = dev->cycles;
+		out[5] = dev->cycles >> 8;
+		out[6] = out[7] = 0x00;
+		out[8] = dev->raw_temperature;
+		out_len = 9;
+		break;
+	default:
+		return;
+	}
+
+	if (sim_chance(cfg.dropout_pct)) {
+		dev->dropped++;
+		return;
+	}
+
+	/* The master gave up on the last request, and moved on. */
+	if (reply_timer.pending)
+		collisions++;
+
+	reply_len = aqualink_msg_to_frame(reply, out, out_len);
+	if (sim_chance(cfg.corrupt_pct)) {
+		dev->corrupted++;
+		bit = rand() % (reply_len * 8);
+		reply[bit / 8] ^= 1 << (bit % 8);
+	}
+
+	uloop_timeout_set(&reply_timer, cfg.delay_ms +
+			  sim_xmit_ms(p->frame_len + reply_len));
+}
+
+static void sim_pty_read(struct uloop_fd *fd, unsigned int events)
+{
+	uint8_t buf[256];
+	ssize_t len;
+
+	while ((len = read(fd->fd, buf, sizeof(buf))) > 0)
+		aqualink_parser_feed(&parser, buf, len);
+}
+
+/* Replies from the daemon are not needed, only the commands going out. */
+static void sim_control_read(struct uloop_fd *fd, unsigned int events)
+{
+	char buf[256];
+	ssize_t len;
+
+	do {
+		len = read(fd->fd, buf, sizeof(buf));
+	} while (len > 0);
+
+	if (len == 0) {
+		fprintf(stderr, "control socket closed\n");
+		uloop_fd_delete(fd);
+	}
+}
+
+/* Changes the pool setpoint of one device that has been polled, in turn */
+static void sim_send_command(struct uloop_timeout *t)
+{
+	struct sim_dev *dev;
+	char line[64];
+	unsigned int i;
+	int len, temp;
+
+	uloop_timeout_set(t, cfg.command_interval_ms);
+
+	for (i = 0; i < cfg.num_devs; i++) {
+		dev = &devs[next_command_dev++ % cfg.num_devs];
+		if (dev->polls && dev->want_pool < 0)
+			break;
+	}
+	if (i == cfg.num_devs)
+		return;
+
+	temp = dev->pool_setpoint == 25 ? 26 : 25;
+	len = snprintf(line, sizeof(line), "setpoint 0x%02x pool %dC\n",
+		       dev->addr, temp);
+	if (write(control.fd, line, len) != len)
+		return;
+
+	dev->want_pool = temp;
+	dev->want_us = monotonic_us();
+}
+
+static int sim_connect(const char *path)
+{
+	struct sockaddr_un sun = { .sun_family = AF_UNIX };
+	int fd;
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -errno;
+
+	strncpy(sun.sun_path, path, sizeof(sun.sun_path) - 1);
+	if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+		close(fd);
+		return -errno;
+	}
+
+	return fd;
+}
+
+/* Waits for the daemon's socket, which appears once it is running. */
+static void sim_try_connect(struct uloop_timeout *t)
+{
+	int fd = sim_connect(cfg.socket_path);
+
+	if (fd < 0) {
+		uloop_timeout_set(t, 200);
+		return;
+	}
+
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	control.fd = fd;
+	control.cb = sim_control_read;
+	uloop_fd_add(&control, ULOOP_READ);
+
+	t->cb = sim_send_command;
+	uloop_timeout_set(t, cfg.command_interval_ms);
+}
+
+static int sim_open_pty(void)
+{
+	struct termios tio;
+	const char *name;
+	int fd;
+
+	fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if (fd < 0 || grantpt(fd) || unlockpt(fd))
+		return -errno;
+
+	/*
+	 * Keep the other side open, so that reads don't fail until the daemon
+	 * opens it, nor after it exits.
+	 */
+	name = ptsname(fd);
+	if (!name || open(name, O_RDWR | O_NOCTTY) < 0)
+		return -errno;
+
+	tcgetattr(fd, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(fd, TCSANOW, &tio);
+
+	if (cfg.link_path) {
+		unlink(cfg.link_path);
+		if (symlink(name, cfg.link_path) < 0)
+			return -errno;
+	}
+
+	printf("pty=%s\n", name);
+	fflush(stdout);
+	return fd;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void sim_report_latency(void)
+{
+	uint64_t sum = 0;
+	unsigned int i;
+
+	if (!num_latency)
+		return;
+
+	qsort(latency_us, num_latency, sizeof(latency_us[0]), cmp_u32);
+	for (i = 0; i < num_latency; i++)
+		sum += latency_us[i];
+
+	printf("command_latency count=%u avg_us=%llu p50_us=%u p99_us=%u "
+	       "max_us=%u\n", num_latency,
+	       (unsigned long long)sum / num_latency,
+	       latency_us[num_latency / 2],
+	       latency_us[num_latency * 99 / 100],
+	       latency_us[num_latency - 1]);
+}
+
+static void sim_report(void)
+{
+	double elapsed_s = (monotonic_us() - start_us) / 1e6;
+	unsigned long polls = 0;
+	struct sim_dev *dev;
+	double interval_ms;
+	unsigned int i;
+
+	for (i = 0; i < cfg.num_devs; i++) {
+		dev = &devs[i];
+		polls += dev->polls;
+		interval_ms = dev->polls > 1 ?
+			(dev->last_poll_us - dev->first_poll_us) / 1e3 /
+			(dev->polls - 1) : 0;
+		printf("dev 0x%02x probes=%lu polls=%lu commands=%lu "
+		       "dropped=%lu corrupted=%lu poll_interval_ms=%.1f\n",
+		       dev->addr, dev->probes, dev->polls, dev->commands,
+		       dev->dropped, dev->corrupted, interval_ms);
+	}
+
+	printf("devices=%u elapsed_s=%.1f requests=%lu bad_requests=%lu "
+	       "collisions=%lu polls_per_s=%.2f\n", cfg.num_devs, elapsed_s,
+	       requests, bad_requests, collisions, polls / elapsed_s);
+	sim_report_latency();
+}
+
+/* The bus-wide lines of "stats", including the time lost to timeouts */
+static void sim_report_daemon(void)
+{
+	char buf[16384], *line, *next;
+	struct pollfd pfd;
+	size_t len = 0;
+	ssize_t ret;
+	int fd;
+
+	fd = sim_connect(cfg.socket_path);
+	if (fd < 0)
+		return;
+
+	if (write(fd, "stats\n", 6) != 6)
+		goto out;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	while (len < sizeof(buf) - 1 && poll(&pfd, 1, 1000) > 0) {
+		ret = read(fd, buf + len, sizeof(buf) - 1 - len);
+		if (ret <= 0)
+			break;
+		len += ret;
+		buf[len] = '\0';
+		if (strstr(buf, "\nOK\n") || strstr(buf, "ERROR"))
+			break;
+	}
+	buf[len] = '\0';
+
+	for (line = buf; line && *line; line = next) {
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = '\0';
+		if (!strncmp(line, "bus", 3) && !strstr(line, " dev "))
+			printf("daemon %s\n", line);
+	}
+
+out:
+	close(fd);
+}
+
+static void sim_end(struct uloop_timeout *t)
+{
+	uloop_end();
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int seed = 1, i;
+	int opt, fd;
+
+	const struct option options[] = {
+		{"devices", required_argument, 0, 'n'},
+		{"first-addr", required_argument, 0, 'a'},
+		{"delay-ms", required_argument, 0, 'd'},
+		{"dropout", required_argument, 0, 'D'},
+		{"corrupt", required_argument, 0, 'C'},
+		{"baud", required_argument, 0, 'b'},
+		{"duration", required_argument, 0, 't'},
+		{"socket", required_argument, 0, 's'},
+		{"command-interval", required_argument, 0, 'i'},
+		{"link", required_argument, 0, 'l'},
+		{"seed", required_argument, 0, 'S'},
+		{ }
+	};
+
+	while ((opt = getopt_long(argc, argv, "", options, NULL)) > 0) {
+		switch (opt) {
+		case 'n':
+			cfg.num_devs = strtoul(optarg, NULL, 0);
+			break;
+		case 'a':
+			cfg.first_addr = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			cfg.delay_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'D':
+			cfg.dropout_pct = strtod(optarg, NULL);
+			break;
+		case 'C':
+			cfg.corrupt_pct = strtod(optarg, NULL);
+			break;
+		case 'b':
+			cfg.baud = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			cfg.duration_s = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			cfg.socket_path = optarg;
+			break;
+		case 'i':
+			cfg.command_interval_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			cfg.link_path = optarg;
+			break;
+		case 'S':
+			seed = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (!cfg.num_devs || cfg.num_devs > SIM_MAX_DEVICES || !cfg.baud ||
+	    !cfg.first_addr || cfg.first_addr + cfg.num_devs > 0x100) {
+		fprintf(stderr, "Bad device count or address\n");
+		return EXIT_FAILURE;
+	}
+
+	srand(seed);
+	for (i = 0; i < cfg.num_devs; i++) {
+		devs[i].addr = cfg.first_addr + i;
+		devs[i].gv_on_hours = 18;
+		devs[i].cycles = 315;
+		devs[i].raw_temperature = 20 + 12 + i % 8;
+		devs[i].want_pool = -1;
+	}
+
+	fd = sim_open_pty();
+	if (fd < 0) {
+		fprintf(stderr, "Cannot create pty: %s\n", strerror(-fd));
+		return EXIT_FAILURE;
+	}
+
+	uloop_init();
+	aqualink_parser_init(&parser, sim_handle_request);
+	pty.fd = fd;
+	pty.cb = sim_pty_read;
+	uloop_fd_add(&pty, ULOOP_READ);
+	reply_timer.cb = sim_send_reply;
+
+	if (cfg.socket_path) {
+		command_timer.cb = sim_try_connect;
+		uloop_timeout_set(&command_timer, 0);
+	}
+
+	start_us = monotonic_us();
+	end_timer.cb = sim_end;
+	uloop_timeout_set(&end_timer, cfg.duration_s * 1000);
+
+	uloop_run();
+	uloop_done();
+
+	sim_report();
+	if (cfg.socket_path)
+		sim_report_daemon();
+
+	if (cfg.link_path)
+		unlink(cfg.link_path);
+
+	return 0;
+}
@@ -0,0 +1,114 @@
+/*
+ * Aqualink control - Tests of the JXi heater driver, without a bus
+ *
+ * The daemon's time base is replaced, so that the test can move the clock.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "aqualink-internal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libubox/uloop.h>
+
+static uint64_t test_now_us = 1000000;
+
+uint64_t monotonic_us(void)
+{
+	return test_now_us;
+}
+
+void dev_state_changed(struct device *dev)
+{
+}
+
+static struct device *test_jxi_new(void)
+{
+	const struct device_ops *ops = jxi_heater_driver.ops;
+	struct device *dev;
+
+	dev = calloc(1, ops->size);
+	if (!dev)
+		abort();
+
+	dev->ops = ops;
+	dev->addr = jxi_heater_driver.first_addr;
+	ops->init(dev);
+
+	return dev;
+}
+
+/* Fills 'cmds' with the command byte of each request of a round. */
+static unsigned int test_round(struct device *dev, uint8_t *cmds)
+{
+	uint8_t msg[AQUALINK_MAX_MSG_LEN];
+	unsigned int seq;
+
+	for (seq = 0; seq < DEV_MAX_BATCH; seq++) {
+		if (dev->ops->get_next_request(dev, seq, msg, sizeof(msg)) <= 0)
+			break;
+		cmds[seq] = msg[1];
+	}
+
+	return seq;
+}
+
+static void test_ack(struct device *dev)
+{
+	const uint8_t reply[] = { 0x00, 0x0d, 0x00, 0x00, 0x00 };
+
+	dev->ops->cmds[0x0d].handle(dev, reply, sizeof(reply));
+}
+
+/*
+ * Every round reads the measurements, whether the command goes out before
+ * them because it changed, or because it is due to be repeated.
+ */
+static int test_jxi_rounds(void)
+{
+	const struct jxi_control ctl = {
+		.flags = JXI_CTL_CELSIUS | JXI_CTL_POOL,
+		.pool_setpoint = 25,
+		.spa_setpoint = 35,
+	};
+	struct device *dev = test_jxi_new();
+	uint8_t cmds[DEV_MAX_BATCH];
+	int fail = 0;
+
+	/* Nothing to send yet but the poll */
+	fail |= test_round(dev, cmds) != 1 || cmds[0] != 0x25;
+
+	fail |= jxi_heater_set_control(dev, &ctl) != 1;
+	fail |= test_round(dev, cmds) != 2 || cmds[0] != 0x0c ||
+		cmds[1] != 0x25;
+	test_ack(dev);
+
+	test_now_us += 500000;
+	fail |= test_round(dev, cmds) != 1 || cmds[0] != 0x25;
+
+	/* The repeat, with the heater in the state it was told */
+	test_now_us += 3000000;
+	fail |= test_round(dev, cmds) != 2 || cmds[0] != 0x0c ||
+		cmds[1] != 0x25;
+	test_ack(dev);
+
+	test_now_us += 500000;
+	fail |= test_round(dev, cmds) != 1 || cmds[0] != 0x25;
+
+	printf("JXi rounds: %s\n", fail ? "FAIL" : "PASS");
+	return fail;
+}
+
+int main(int argc, char *argv[])
+{
+	int num_fail = 0;
+
+	uloop_init();
+	num_fail += test_jxi_rounds();
+	uloop_done();
+
+	return num_fail;
+}
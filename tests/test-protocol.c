@@ -9,8 +9,13 @@
 #include "aqualink-internal.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <libubox/utils.h>
 
 static void dump_sump(const uint8_t *buf, size_t len)
 {
@@ -51,6 +56,46 @@ static int test_frame_encoding(const uint8_t *frame, size_t frame_len,
 	return ret;
 }
 
+static int test_reference_decoder(const uint8_t *frame, size_t frame_len)
+{
+	uint8_t ref[64], buf[64];
+	int ref_len, len, ret;
+
+	ref_len = aqualink_frame_to_msg_ref(ref, frame, frame_len);
+	len = aqualink_frame_to_msg(buf, frame, frame_len);
+	ret = (len != ref_len) || (len > 0 && memcmp(ref, buf, len));
+	printf("Reference decoder: %s (ret=%d, ref=%d)\n",
+	       ret ? "FAIL" : "PASS", len, ref_len);
+
+	return ret;
+}
+
+static int test_incremental_decode(const uint8_t *frame, size_t frame_len,
+				   const uint8_t *message, size_t msg_len)
+{
+	struct aqualink_decoder dec;
+	uint8_t buf[64];
+	size_t i, consumed;
+	int len = -EAGAIN;
+
+	aqualink_decoder_init(&dec, buf, sizeof(buf));
+
+	/* Feed one byte at a time, like a slow tty would. */
+	for (i = 0; i < frame_len; i++) {
+		len = aqualink_decoder_feed(&dec, frame + i, 1, &consumed);
+		assert(consumed == 1);
+		if (len != -EAGAIN)
+			break;
+	}
+
+	assert(i == frame_len - 1);
+	assert(len == msg_len);
+	len = memcmp(message, buf, msg_len);
+	printf("Incremental decoding: %s\n", len ? "FAIL" : "PASS");
+
+	return len;
+}
+
 static int test_framer(void)
 {
 	const uint8_t frame1[] = {0x10, 0x02, 0x68, 0x10, 0x00, 0xbe, 0x10, 0x00, 0x58, 0x10, 0x03};
@@ -60,9 +105,27 @@ static int test_framer(void)
 	const uint8_t csum_10_msg[] = {0xFE};
 	const uint8_t csum_10_frame[] = {0x10, 0x02, 0xFE, 0x10, 0x00, 0x10, 0x03};
 
+	const uint8_t bad_csum_frame[] = {0x10, 0x02, 0xFE, 0x11, 0x10, 0x03};
+	const uint8_t bad_footer_frame[] = {0x10, 0x02, 0xFE, 0x10, 0x00, 0x10, 0x04};
+
 	uint8_t buf[sizeof(frame2)];
 	int ret;
 
+	ret = test_reference_decoder(frame1, sizeof(frame1));
+	ret |= test_reference_decoder(frame2, sizeof(frame2));
+	ret |= test_reference_decoder(csum_10_frame, sizeof(csum_10_frame));
+	ret |= test_reference_decoder(bad_csum_frame, sizeof(bad_csum_frame));
+	ret |= test_reference_decoder(bad_footer_frame, sizeof(bad_footer_frame));
+	if (ret)
+		return ret;
+
+	ret = test_incremental_decode(frame1, sizeof(frame1),
+				      message1, sizeof(message1));
+	ret |= test_incremental_decode(csum_10_frame, sizeof(csum_10_frame),
+				       csum_10_msg, sizeof(csum_10_msg));
+	if (ret)
+		return ret;
+
 	ret = test_frame_encoding(frame1, sizeof(frame1),
 				  message1, sizeof(message1), buf);
 	if (ret)
@@ -84,6 +147,216 @@ static int test_framer(void)
 				   message2, sizeof(message2), buf);
 }
 
+struct parser_result {
+	struct aqualink_parser parser;
+	int lens[8];
+	size_t num_msgs;
+};
+
+static void collect_msg(struct aqualink_parser *p, const uint8_t *msg, int len)
+{
+	struct parser_result *res = (struct parser_result *)p;
+
+	assert(res->num_msgs < 8);
+	res->lens[res->num_msgs++] = len;
+}
+
+static int test_stream_parser(void)
+{
+	const uint8_t stream[] = {
+		/* Junk, including a lone 0x10 */
+		0xaa, 0x10, 0x55,
+		/* Good frame */
+		0x10, 0x02, 0x68, 0x10, 0x00, 0xbe, 0x10, 0x00, 0x58, 0x10, 0x03,
+		/* Bad checksum */
+		0x10, 0x02, 0xFE, 0x11, 0x10, 0x03,
+		/* Truncated frame interrupted by a new header */
+		0x10, 0x02, 0x68, 0x25,
+		0x10, 0x02, 0xFE, 0x10, 0x00, 0x10, 0x03,
+		/* Invalid escape, where the 0x10 starts the next header */
+		0x10, 0x02, 0x68, 0x10, 0x10, 0x02, 0xFE, 0x10, 0x00, 0x10, 0x03,
+	};
+	const int expected[] = { 4, -EPROTO, 1, -EINVAL, 1 };
+	struct parser_result chunk = { }, bytes = { };
+	size_t i;
+	int ret;
+
+	aqualink_parser_init(&chunk.parser, collect_msg);
+	aqualink_parser_feed(&chunk.parser, stream, sizeof(stream));
+
+	aqualink_parser_init(&bytes.parser, collect_msg);
+	for (i = 0; i < sizeof(stream); i++)
+		aqualink_parser_feed(&bytes.parser, stream + i, 1);
+
+	ret = chunk.num_msgs != ARRAY_SIZE(expected);
+	ret |= memcmp(chunk.lens, expected, sizeof(expected));
+	ret |= memcmp(chunk.lens, bytes.lens, sizeof(chunk.lens));
+	ret |= chunk.parser.frames != 3 || chunk.parser.errors != 2;
+	ret |= chunk.parser.resyncs != 2 || chunk.parser.junk_bytes != 3;
+	ret |= chunk.parser.frames != bytes.parser.frames;
+	ret |= chunk.parser.resyncs != bytes.parser.resyncs;
+	ret |= chunk.parser.junk_bytes != bytes.parser.junk_bytes;
+	printf("Stream parser: %s (frames=%lu errors=%lu resyncs=%lu junk=%lu)\n",
+	       ret ? "FAIL" : "PASS", chunk.parser.frames, chunk.parser.errors,
+	       chunk.parser.resyncs, chunk.parser.junk_bytes);
+
+	return ret;
+}
+
+/* Framing in place must give the same bytes as framing from a copy. */
+static int test_frame_in_place(void)
+{
+	uint8_t msg[AQUALINK_MAX_MSG_LEN], expected[AQUALINK_MAX_FRAME_LEN];
+	const uint8_t csum_10_frame[] = {0x10, 0x02, 0xFE, 0x10, 0x00, 0x10, 0x03};
+	uint8_t buf[AQUALINK_MAX_FRAME_LEN];
+	size_t len, i, expected_len, frame_len;
+	int fail = 0;
+
+	for (len = 1; len <= sizeof(msg); len++) {
+		/* Mix in runs of 0x10, including a trailing one */
+		for (i = 0; i < len; i++)
+			msg[i] = (i % 3 && i != len - 1) ? i * 37 : 0x10;
+
+		expected_len = aqualink_msg_to_frame(expected, msg, len);
+
+		memset(buf, 0xaa, sizeof(buf));
+		memcpy(buf + 2, msg, len);
+		frame_len = aqualink_frame_in_place(buf, len);
+
+		assert(frame_len <= AQUALINK_FRAME_CAPACITY(len));
+		if (frame_len != expected_len || memcmp(buf, expected, frame_len))
+			fail = 1;
+	}
+
+	/* The checksum of this one is 0x10, which needs escaping as well. */
+	buf[2] = 0xfe;
+	frame_len = aqualink_frame_in_place(buf, 1);
+	fail |= frame_len != sizeof(csum_10_frame) ||
+		memcmp(buf, csum_10_frame, frame_len);
+
+	printf("In-place framing: %s\n", fail ? "FAIL" : "PASS");
+	return fail;
+}
+
+/*
+ * Random messages of every length, including the longest, must survive
+ * framing and come back from both the decoder and the stream parser.
+ */
+static int test_random_round_trip(void)
+{
+	uint8_t msg[AQUALINK_MAX_MSG_LEN], frame[AQUALINK_MAX_FRAME_LEN];
+	uint8_t out[AQUALINK_MAX_FRAME_LEN];
+	struct parser_result res;
+	size_t len, frame_len, i;
+	int n, ret, fail = 0;
+
+	srand(1);
+	for (n = 0; n < 1000; n++) {
+		len = rand() % AQUALINK_MAX_MSG_LEN + 1;
+		/* Plenty of 0x10, so that escapes come back to back */
+		for (i = 0; i < len; i++)
+			msg[i] = rand() & 1 ? 0x10 : rand();
+
+		frame_len = aqualink_msg_to_frame(frame, msg, len);
+		ret = aqualink_frame_to_msg(out, frame, frame_len);
+		fail |= ret != (int)len || memcmp(out, msg, len);
+
+		ret = aqualink_frame_to_msg_ref(out, frame, frame_len);
+		fail |= ret != (int)len || memcmp(out, msg, len);
+
+		memset(&res, 0, sizeof(res));
+		aqualink_parser_init(&res.parser, collect_msg);
+		aqualink_parser_feed(&res.parser, frame, frame_len);
+		fail |= res.num_msgs != 1 || res.lens[0] != (int)len;
+	}
+
+	printf("Random round trip: %s\n", fail ? "FAIL" : "PASS");
+	return fail;
+}
+
+static void count_sample(const struct history_sample *s, void *priv)
+{
+	uint32_t *last_s = priv;
+
+	assert(s->time_s > *last_s);
+	*last_s = s->time_s;
+}
+
+/*
+ * The ring keeps the newest samples, hands them out oldest first, and still
+ * has them after being closed and opened again.
+ */
+static int test_history(void)
+{
+	char path[] = "/tmp/test-history-XXXXXX";
+	struct history h;
+	int32_t values[HISTORY_MAX_VALUES] = { };
+	uint32_t t, last_s = 0;
+	size_t n;
+	int fd, fail = 0;
+
+	fd = mkstemp(path);
+	assert(fd >= 0);
+	close(fd);
+
+	fail |= history_open(&h, path, 4, 10) != 0;
+	/* Samples closer together than the interval are dropped. */
+	for (t = 10; t <= 400; t += 5) {
+		values[0] = t;
+		history_add(&h, t, values);
+	}
+
+	/* Two batches flushed, of which the ring kept four, and 8 pending */
+	n = history_query(&h, 0, UINT32_MAX, count_sample, &last_s);
+	fail |= n != 4 + 8 || last_s != 400;
+	fail |= history_query(&h, 370, 385, count_sample, &(uint32_t){ 0 }) != 2;
+	history_close(&h);
+
+	last_s = 0;
+	fail |= history_open(&h, path, 4, 10) != 0;
+	history_add(&h, 405, values);
+	n = history_query(&h, 0, UINT32_MAX, count_sample, &last_s);
+	fail |= n != 4 || last_s != 400;
+	history_close(&h);
+
+	/* A different layout starts over. */
+	fail |= history_open(&h, path, 8, 10) != 0;
+	fail |= history_query(&h, 0, UINT32_MAX, count_sample,
+			      &(uint32_t){ 0 }) != 0;
+	history_close(&h);
+	unlink(path);
+
+	printf("History ring: %s\n", fail ? "FAIL" : "PASS");
+	return fail;
+}
+
+/*
+ * On a bus with steady timing, replies held up by a couple of milliseconds
+ * of scheduling on either end must not time out. A JXi poll and its reply
+ * take about 24 ms at 9600 baud.
+ */
+static int test_rtt_steady(void)
+{
+	const uint32_t rtt_us = 24000, floor_us = 20000;
+	struct device dev = { .connected = 1 };
+	uint32_t late_us;
+	int i, fail = 0;
+
+	for (late_us = 0; late_us <= 3000; late_us += 500) {
+		for (i = 0; i < 200; i++)
+			dev_update_rtt(&dev, rtt_us);
+
+		fail |= rtt_us + late_us >= dev_rtt_timeout_us(&dev, floor_us);
+		dev_update_rtt(&dev, rtt_us + late_us);
+	}
+
+	/* Never less than the time the reply needs on the wire */
+	fail |= dev_rtt_timeout_us(&dev, 100000) < 100000;
+
+	printf("Steady RTT: %s\n", fail ? "FAIL" : "PASS");
+	return fail;
+}
+
 static int test_packet_escape(void)
 {
 	const uint8_t expected[] = "\x68\x10\x00\xbe\x10\x00\x9f";
@@ -120,8 +393,13 @@ int main(int argc, char *argv[])
 	int num_fail = 0;
 
 	num_fail += test_framer();
+	num_fail += test_frame_in_place();
 	num_fail += test_packet_escape();
 	num_fail += test_packet_unescape();
+	num_fail += test_stream_parser();
+	num_fail += test_random_round_trip();
+	num_fail += test_history();
+	num_fail += test_rtt_steady();
 
 	return num_fail;
 }